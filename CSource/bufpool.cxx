@@ -0,0 +1,145 @@
+#include "bufpool.h"
+#include <stdlib.h>
+#include <pthread.h>
+#include <iostream>
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+// Each buffer has a POOL_ALIGN-byte header in front of it that records its
+// size class (and links it into the free list while it's cached).
+struct poolHeader {
+  poolHeader *next;
+  size_t classBytes;
+  int classIdx;
+};
+
+#define POOL_CLASSES 256
+#define HUGE_PAGE (2*1024*1024)
+
+static poolHeader *freeList[POOL_CLASSES];
+static poolStats stats;
+static size_t cacheLimit = (size_t)512*1024*1024;
+static int hugePages = 0;
+static pthread_mutex_t poolLock = PTHREAD_MUTEX_INITIALIZER;
+
+static int sizeClass(size_t bytes, size_t *classBytes)
+{
+  // 256 bytes and under share class 0; above that, the classes are
+  // m*2^k for m = 4..7.
+  int k = 6;
+  size_t m;
+
+  if (bytes <= 256){
+    *classBytes = 256;
+    return 0;
+  }
+  while (((size_t)8 << k) < bytes) k++;
+  m = (bytes + ((size_t)1 << k) - 1) >> k;	// 5..8
+  if (m==8){ m = 4; k++; }
+  *classBytes = m << k;
+  return (k-6)*4 + (int)(m-4);
+}
+
+void *poolAlloc(size_t bytes)
+{
+  size_t classBytes;
+  int idx = sizeClass(bytes, &classBytes);
+  poolHeader *h = NULL;
+  void *block;
+
+  pthread_mutex_lock(&poolLock);
+  stats.allocs++;
+  if (idx < POOL_CLASSES && freeList[idx]){
+    h = freeList[idx];
+    freeList[idx] = h->next;
+    stats.reused++;
+    stats.bytesCached -= classBytes;
+  }
+  stats.bytesInUse += classBytes;
+  if (stats.bytesInUse+stats.bytesCached > stats.peakBytes)
+    stats.peakBytes = stats.bytesInUse+stats.bytesCached;
+  pthread_mutex_unlock(&poolLock);
+  if (h) return (char *)h + POOL_ALIGN;
+
+  size_t align = POOL_ALIGN, total = POOL_ALIGN + classBytes;
+  if (hugePages && classBytes >= HUGE_PAGE) align = HUGE_PAGE;
+  if (posix_memalign(&block, align, total) != 0){
+    std::cerr << "ERROR: out of memory (" << total << " bytes)" << std::endl;
+    pthread_mutex_lock(&poolLock);
+    stats.bytesInUse -= classBytes;
+    stats.failed++;
+    pthread_mutex_unlock(&poolLock);
+    return NULL;
+  }
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+  if (align==HUGE_PAGE) madvise(block, total & ~(size_t)(HUGE_PAGE-1), MADV_HUGEPAGE);
+#endif
+  h = (poolHeader *)block;
+  h->next = NULL;
+  h->classBytes = classBytes;
+  h->classIdx = idx;
+  return (char *)block + POOL_ALIGN;
+}
+
+void poolFree(void *p)
+{
+  if (p==NULL) return;
+  poolHeader *h = (poolHeader *)((char *)p - POOL_ALIGN);
+  int keep;
+
+  pthread_mutex_lock(&poolLock);
+  stats.frees++;
+  stats.bytesInUse -= h->classBytes;
+  keep = (h->classIdx < POOL_CLASSES && stats.bytesCached + h->classBytes <= cacheLimit);
+  if (keep){
+    h->next = freeList[h->classIdx];
+    freeList[h->classIdx] = h;
+    stats.bytesCached += h->classBytes;
+  }
+  pthread_mutex_unlock(&poolLock);
+  if (!keep) free(h);
+}
+
+void poolTrim()
+{
+  int i;
+  pthread_mutex_lock(&poolLock);
+  for (i=0; i<POOL_CLASSES; i++){
+    while (freeList[i]){
+      poolHeader *h = freeList[i];
+      freeList[i] = h->next;
+      free(h);
+    }
+  }
+  stats.bytesCached = 0;
+  pthread_mutex_unlock(&poolLock);
+}
+
+void poolSetCacheLimit(size_t bytes)
+{
+  pthread_mutex_lock(&poolLock);
+  cacheLimit = bytes;
+  pthread_mutex_unlock(&poolLock);
+}
+
+void poolSetHugePages(int on)
+{
+  hugePages = on;
+}
+
+void poolGetStats(poolStats &s)
+{
+  pthread_mutex_lock(&poolLock);
+  s = stats;
+  pthread_mutex_unlock(&poolLock);
+}
+
+void poolPrintStats()
+{
+  poolStats s;
+  poolGetStats(s);
+  std::cerr << "buffer pool: " << s.allocs << " allocs (" << s.reused << " reused), "
+	    << s.frees << " frees, " << s.bytesInUse/1024 << " KB in use, "
+	    << s.bytesCached/1024 << " KB cached, peak " << s.peakBytes/1024 << " KB" << std::endl;
+}
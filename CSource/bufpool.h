@@ -0,0 +1,50 @@
+#ifndef __bufpool_h
+#define __bufpool_h
+
+/*
+ *    Aligned buffer pool for the big float blocks: img planes, FFT buffers
+ *    and kernel spectra.
+ *
+ *    Every buffer is POOL_ALIGN-byte aligned, which is at least what
+ *    fftwf_malloc gives, so FFTW can plan its SIMD codelets on them.
+ *    (Free them with poolFree though, not fftwf_free.)
+ *
+ *    Sizes are rounded up to a size class (four per power of two, so at
+ *    most 25% slack). poolFree keeps the buffer on its class's free list,
+ *    and the next poolAlloc of that class gets it back, so a run of
+ *    same-sized images allocates once. Cached buffers beyond the cache
+ *    limit go straight back to the system.
+ *
+ *    Thread safe.
+ */
+
+#include <stddef.h>
+
+#define POOL_ALIGN 64
+
+// NULL (and a message on cerr) if the system is out of memory
+void *poolAlloc(size_t bytes);
+void poolFree(void *p);		// NULL is fine
+inline float *poolAllocFloat(size_t n) {return (float *)poolAlloc(n*sizeof(float));}
+
+struct poolStats {
+  long allocs;		// poolAlloc calls
+  long reused;		// ... of which came off a free list
+  long frees;		// poolFree calls
+  size_t bytesInUse;	// handed out and not yet freed
+  size_t bytesCached;	// freed and kept for reuse
+  size_t peakBytes;	// largest bytesInUse+bytesCached so far
+  long failed;		// poolAlloc calls that got NULL
+};
+
+void poolGetStats(poolStats &s);
+void poolPrintStats();		// to cerr
+
+// Give the cached buffers back to the system
+void poolTrim();
+// Largest total that is kept cached (default 512 MB)
+void poolSetCacheLimit(size_t bytes);
+// Ask for transparent huge pages on buffers of 2 MB and up (Linux only)
+void poolSetHugePages(int on);
+
+#endif // __bufpool_h
@@ -0,0 +1,55 @@
+// checkFFTSize: checks fftSmoothSize, and fftGoodSize in its smooth modes,
+// against a brute-force list of smooth numbers, for every n from 1 to
+// FFT_CHECK_MAX and maxPrime 7, 11 and 13. Exits nonzero on any mismatch.
+//
+// make check (or ./checkFFTSize)
+
+#include "fftplan.h"
+#include <stdio.h>
+#include <string.h>
+
+#define FFT_CHECK_MAX 65536
+// room past FFT_CHECK_MAX for the next smooth number
+#define FFT_CHECK_LIST (2*FFT_CHECK_MAX)
+
+static int checkPrime(int maxPrime, char *smooth)
+{
+  static const int primes[6] = {2, 3, 5, 7, 11, 13};
+  int n, m, i, next, bad = 0, worst = 0;
+
+  // every product of the primes up to maxPrime, marked off from 1
+  memset(smooth, 0, FFT_CHECK_LIST+1);
+  smooth[1] = 1;
+  for (i=0; i<6 && primes[i]<=maxPrime; i++)
+    for (m=1; m*primes[i]<=FFT_CHECK_LIST; m++)
+      if (smooth[m]) smooth[m*primes[i]] = 1;
+
+  fftSetSizeMode(maxPrime, 0);
+  next = FFT_CHECK_LIST;
+  for (n=FFT_CHECK_MAX; n>=1; n--){
+    if (smooth[n]) next = n;
+    if (next-n > worst) worst = next-n;
+    if (fftSmoothSize(n, maxPrime)!=next || fftGoodSize(n)!=next){
+      if (bad++ < 10)
+	printf("  n %d: expected %d, fftSmoothSize %d, fftGoodSize %d\n",
+	       n, next, fftSmoothSize(n, maxPrime), fftGoodSize(n));
+    }
+  }
+  printf("maxPrime %2d: %d of %d sizes wrong (worst gap %d)\n", maxPrime, bad, FFT_CHECK_MAX, worst);
+  return bad==0;
+}
+
+int main()
+{
+  char *smooth = new char[FFT_CHECK_LIST+1];
+  int ok = 1;
+
+  ok &= checkPrime(7, smooth);
+  ok &= checkPrime(11, smooth);
+  ok &= checkPrime(13, smooth);
+  fftSetSizeMode(7, 0);
+
+  delete [] smooth;
+  printf(ok ? "fft sizes: ok\n" : "fft sizes: FAILED\n");
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,68 @@
+// checkFixed: runs every 8-bit RGB color through the simulation with and
+// without --fixed (simOptions::fixedPoint) and compares the output bytes.
+// Exits nonzero if any differ by more than FIXED_CHECK_BOUND.
+//
+// make check (or ./checkFixed [display])
+
+#include "runSimulation.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// the most an output byte of the fixed-point pipeline may be off by
+#define FIXED_CHECK_BOUND 0
+
+static int checkOne(const unsigned char *colors, unsigned char *flt, unsigned char *fix,
+		    char *sensorType, char *disp, char model, float severity)
+{
+  const long n = 3L*4096*4096;
+  simOptions opts;
+  long i, bad = 0;
+  int d, worst = 0;
+
+  opts.model = model;
+  opts.severity = severity;
+  memcpy(flt, colors, n);
+  runSimulation(flt, 4096, 4096, 0, 90, sensorType, disp, disp, NULL, NULL, NULL, opts);
+  opts.fixedPoint = 1;
+  memcpy(fix, colors, n);
+  runSimulation(fix, 4096, 4096, 0, 90, sensorType, disp, disp, NULL, NULL, NULL, opts);
+
+  for (i=0; i<n; i++){
+    d = abs((int)flt[i] - (int)fix[i]);
+    if (d > worst) worst = d;
+    if (d > FIXED_CHECK_BOUND) bad++;
+  }
+  printf("%-12s %-7s model %c, severity %3.0f: %ld bytes off by more than %d (worst %d)\n",
+	 sensorType, disp, model, severity*100.0, bad, FIXED_CHECK_BOUND, worst);
+  return bad==0;
+}
+
+int main(int argc, char **argv)
+{
+  char *disp = (argc > 1) ? argv[1] : (char *)"CRT";
+  const long n = 3L*4096*4096;
+  unsigned char *colors = new unsigned char[n];
+  unsigned char *flt = new unsigned char[n], *fix = new unsigned char[n];
+  long i;
+  int ok = 1;
+
+  // every color once: R, G and B are the low, middle and high bytes of i
+  for (i=0; i<n/3; i++){
+    colors[3*i  ] = i & 0xff;
+    colors[3*i+1] = (i>>8) & 0xff;
+    colors[3*i+2] = i>>16;
+  }
+  ok &= checkOne(colors, flt, fix, (char *)"normal", disp, 'b', 1.0);
+  ok &= checkOne(colors, flt, fix, (char *)"protanope", disp, 'b', 1.0);
+  ok &= checkOne(colors, flt, fix, (char *)"deuteranope", disp, 'b', 1.0);
+  ok &= checkOne(colors, flt, fix, (char *)"tritanope", disp, 'b', 1.0);
+  ok &= checkOne(colors, flt, fix, (char *)"deuteranope", disp, 'v', 1.0);
+  ok &= checkOne(colors, flt, fix, (char *)"protanope", disp, 'm', 0.5);
+
+  delete [] colors;
+  delete [] flt;
+  delete [] fix;
+  printf(ok ? "fixed point: ok\n" : "fixed point: FAILED\n");
+  return ok ? 0 : 1;
+}
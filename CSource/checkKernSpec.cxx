@@ -0,0 +1,109 @@
+// checkKernSpec: checks kernelSpectrum and kernelCosineSpectrum against a
+// DFT, summed directly in double, of the kernel sampled the way each
+// describes it: cut off half a period each side of 0, or wrapped round a
+// period of 2n. For several n and sums of Gaussians, from SD 0 to terms
+// many times wider than the period. Exits nonzero if any value is off by
+// more than KERNSPEC_CHECK_TOL (of scale).
+//
+// make check (or ./checkKernSpec)
+
+#include "kernspec.h"
+#include <math.h>
+#include <stdio.h>
+
+#define KERNSPEC_CHECK_TOL 1.0e-5
+
+static const int ns[] = {7, 8, 37, 64, 101, 400, 945, 1000, 2688};
+#define N_NS ((int)(sizeof(ns)/sizeof(ns[0])))
+
+// weights and SDs (pixels) of the kernels tried
+static const float kernels[][6] = {
+  {1.0, 0.0, 0.0,		0.0, 0.0, 0.0},
+  {0.9207, 0.105, -0.108,	0.3, 1.0, 2.5},
+  {0.9207, 0.105, -0.108,	0.0, 0.9, 10.0},
+  {0.9207, 0.105, -0.108,	1.0, 10.0, 60.0},
+  {0.5, 0.5, 0.0,		2.5, 60.0, 234.0},
+  {0.9207, 0.105, -0.108,	10.0, 234.0, 900.0},
+  {0.9207, 0.105, -0.108,	60.0, 900.0, 0.0},
+  {1.0, 0.0, 0.0,		900.0, 0.0, 0.0},
+};
+#define N_KERNELS ((int)(sizeof(kernels)/sizeof(kernels[0])))
+
+static double tap(const float kW[3], const float kSD[3], double d)
+{
+  double v = 0.0, sd;
+  int t;
+
+  for (t=0; t<3; t++){
+    if (kW[t]==0.0) continue;
+    sd = (kSD[t]==0.0) ? 0.001 : kSD[t];
+    v += kW[t]/sd*exp(-d*d/(2.0*sd*sd));
+  }
+  return v;
+}
+
+// largest difference, as a share of scale, between got[f*stride] and the
+// real DFT of the n taps scaled to sum to scale, for f < nOut
+static double worstError(const double *taps, int n, int nOut, float scale,
+			 const float *got, int stride, double *cosTab)
+{
+  double total = 0.0, v, e, worst = 0.0;
+  int i, f;
+
+  for (i=0; i<n; i++){
+    total += taps[i];
+    cosTab[i] = cos(2.0*M_PI*i/n);
+  }
+  total = fabs(total);
+  for (f=0; f<nOut; f++){
+    v = 0.0;
+    for (i=0; i<n; i++) v += taps[i]*cosTab[(long)f*i % n];
+    e = fabs(scale*v/total - got[f*stride])/scale;
+    if (e > worst) worst = e;
+  }
+  return worst;
+}
+
+int main()
+{
+  int maxN = ns[N_NS-1];
+  double *taps = new double[2*maxN], *cosTab = new double[2*maxN];
+  float *got = new float[2*maxN];
+  double cutWorst, wrapWorst, e, maxSD;
+  float scale;
+  long j, far;
+  int a, k, i, n, ok = 1;
+
+  for (a=0; a<N_NS; a++){
+    n = ns[a];
+    cutWorst = wrapWorst = 0.0;
+    for (k=0; k<N_KERNELS; k++){
+      const float *kW = kernels[k], *kSD = kernels[k]+3;
+      scale = (k % 2) ? 1.0 : 2.5;
+
+      // cut off: -n/2 < j <= n/2
+      for (i=0; i<n; i++) taps[i] = tap(kW, kSD, (i <= n/2) ? i : n-i);
+      kernelSpectrum(n, n, kW, kSD, scale, got);
+      e = worstError(taps, n, n, scale, got, 2, cosTab);
+      if (e > cutWorst) cutWorst = e;
+
+      // wrapped round 2n, out to 10 SD
+      maxSD = 0.0;
+      for (i=0; i<3; i++) if (kW[i]!=0.0 && kSD[i] > maxSD) maxSD = kSD[i];
+      far = (long)ceil(10.0*maxSD) + 2*n;
+      for (i=0; i<2*n; i++) taps[i] = 0.0;
+      for (j=-far; j<=far; j++) taps[((j % (2*n)) + 2*n) % (2*n)] += tap(kW, kSD, (double)j);
+      kernelCosineSpectrum(n, kW, kSD, scale, got);
+      e = worstError(taps, 2*n, n, scale, got, 1, cosTab);
+      if (e > wrapWorst) wrapWorst = e;
+    }
+    printf("n %4d: worst error %.2g cut off, %.2g mirrored\n", n, cutWorst, wrapWorst);
+    if (cutWorst > KERNSPEC_CHECK_TOL || wrapWorst > KERNSPEC_CHECK_TOL) ok = 0;
+  }
+
+  delete [] taps;
+  delete [] cosTab;
+  delete [] got;
+  printf(ok ? "kernel spectra: ok\n" : "kernel spectra: FAILED\n");
+  return ok ? 0 : 1;
+}
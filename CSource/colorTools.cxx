@@ -10,6 +10,8 @@ void displayDevice::init()
 {
   strcpy(displayFilename, "none");
   numGammaSamples = 0;
+  inputTablesValid = 0;
+  anomalousBankValid = 0;
 
   // we can set up the easy transform matricies now (these are simple 
   // color-space rotations and don't depend on sensor or display specs).
@@ -43,7 +45,7 @@ displayDevice::displayDevice(const char *displayType) {
 }
 
 displayDevice::~displayDevice(){
-  delete gammaR;	
+  delete [] gammaR;	
   // also frees gammaG, gammaB, invgammaR, invgammaG, invgammaB
 }
 
@@ -55,6 +57,7 @@ void displayDevice::loadDevice(const char *displayType) {
   //   lapLCD
   //   
 
+  anomalousBankValid = 0;
   if(strcmp(displayType,"CRT")==0){
     rgb2lms[0]= 0.05059983; rgb2lms[1]= 0.08585369; rgb2lms[2]= 0.00952420;
     rgb2lms[3]= 0.01893033; rgb2lms[4]= 0.08925308; rgb2lms[5]= 0.01370054;
@@ -84,6 +87,8 @@ void displayDevice::readDeviceFile(const char *fname) {
   float tmp;
   int i;
 
+  inputTablesValid = 0;
+
   strcpy(displayFilename, fname);
 
   // the display file is binary, all doubles
@@ -97,6 +102,7 @@ void displayDevice::readDeviceFile(const char *fname) {
   i = fread(&tmp,sizeof(float),1,fid);
   numGammaSamples = (int)(0.5+tmp);
  
+  delete [] gammaR;	// (a reload)
   gammaR = new float [numGammaSamples*6];
   gammaG = gammaR+numGammaSamples;
   gammaB = gammaG+numGammaSamples;
@@ -141,9 +147,10 @@ void displayDevice::computeGamma(int numSamples, float r, float g, float b){
   float val, inc, scale, invr, invg, invb;
 
   invr = 1.0/r; invg = 1.0/g; invb = 1.0/b;
+  inputTablesValid = 0;
 
   if(numSamples != numGammaSamples){
-    delete gammaR;
+    delete [] gammaR;
     gammaR = NULL;
     numGammaSamples = numSamples;
   }
@@ -171,3 +178,222 @@ void displayDevice::computeGamma(int numSamples, float r, float g, float b){
     val += inc;
   }
 }
+
+float *displayDevice::getInputTables(float tm[], float scale){
+  // Input pixels are 8-bit, so gamma correction followed by the color
+  // transform tm is exactly
+  //   out[c] = tm[c*3]*gammaR[R] + tm[c*3+1]*gammaG[G] + tm[c*3+2]*gammaB[B]
+  // We precompute the 9 premultiplied tables (256 entries each, table 
+  // c*3+k at inputTables+(c*3+k)*256) so that loading an image is 3 table 
+  // reads and 2 adds per output value. The gamma index for input value v
+  // is the one applyLookupTable would use after assignUchar(data, scale).
+  // The tables are kept until the gamma or the transform changes.
+  float *gam[3];
+  int c, k, v, idx;
+
+  if (inputTablesValid && scale==inputTablesScale){
+    for (k=0; k<9 && tm[k]==inputTablesXform[k]; k++);
+    if (k==9) return inputTables;
+  }
+
+  gam[0] = gammaR; gam[1] = gammaG; gam[2] = gammaB;
+  for (v=0; v<256; v++){
+    idx = (int)(v/scale + 0.5);
+    if (idx > numGammaSamples-1) idx = numGammaSamples-1;
+    for (c=0; c<3; c++)
+      for (k=0; k<3; k++)
+	inputTables[(c*3+k)*256 + v] = gam[k][idx] * tm[c*3+k];
+  }
+  for (k=0; k<9; k++) inputTablesXform[k] = tm[k];
+  inputTablesScale = scale;
+  inputTablesValid = 1;
+  return inputTables;
+}
+
+void displayDevice::getInputTablesFixed(const double tm[], int rows, float scale, 
+				       int fracBits, int out[]){
+  // Same as getInputTables, but rounded to fixed point with fracBits 
+  // fractional bits, for a (rows x 3) transform given in double. Nothing
+  // is cached; out must hold rows*3*256 ints.
+  float *gam[3];
+  double one = (double)(1<<fracBits);
+  int c, k, v, idx;
+
+  gam[0] = gammaR; gam[1] = gammaG; gam[2] = gammaB;
+  for (v=0; v<256; v++){
+    idx = (int)(v/scale + 0.5);
+    if (idx > numGammaSamples-1) idx = numGammaSamples-1;
+    for (c=0; c<rows; c++)
+      for (k=0; k<3; k++)
+	out[(c*3+k)*256 + v] = (int)floor(gam[k][idx] * tm[c*3+k] * one + 0.5);
+  }
+}
+
+void displayDevice::computeVienotTransform(char viewerType, float out[9]){
+  // Dichromat simulation after Vienot, Brettel & Mollon (1999): instead of 
+  // Brettel's two half-planes, all colors are projected onto one plane 
+  // through black, the display white (RGB=1,1,1) and the display blue 
+  // primary (and so also yellow = white-blue). For protans the missing L is
+  // rebuilt as L = a*M + b*S, for deutans M = a*L + b*S, with a and b 
+  // chosen so that white and blue are left alone.
+  // Returns out = proj*rgb2lms, ie. rgb straight to the dichromat's lms.
+  // Only defined for 'p' and 'd'; anything else gets plain rgb2lms.
+  float white[3], blue[3], proj[9];
+  int lost, k1, k2, i, j;
+  double det, a, b;
+
+  for (i=0; i<9; i++) proj[i] = (i%4==0) ? 1.0 : 0.0;
+  for (i=0; i<3; i++){
+    white[i] = rgb2lms[i*3]+rgb2lms[i*3+1]+rgb2lms[i*3+2];
+    blue[i] = rgb2lms[i*3+2];
+  }
+
+  if (viewerType=='p' || viewerType=='d'){
+    if (viewerType=='p'){ lost = 0; k1 = 1; k2 = 2; }
+    else                { lost = 1; k1 = 0; k2 = 2; }
+    // solve [w_k1 w_k2; b_k1 b_k2]*[a;b] = [w_lost; b_lost]
+    det = white[k1]*blue[k2] - white[k2]*blue[k1];
+    a = (white[lost]*blue[k2] - white[k2]*blue[lost])/det;
+    b = (white[k1]*blue[lost] - white[lost]*blue[k1])/det;
+    proj[lost*3+lost] = 0.0;
+    proj[lost*3+k1] = a;
+    proj[lost*3+k2] = b;
+  }
+
+  for (i=0; i<3; i++)
+    for (j=0; j<3; j++)
+      out[i*3+j] = proj[i*3]*rgb2lms[j] + proj[i*3+1]*rgb2lms[3+j] + proj[i*3+2]*rgb2lms[6+j];
+}
+
+// Machado, Oliveira & Fernandes (2009) anomalous trichromat simulation 
+// matrices, in linear sRGB, for severity 0.0, 0.1, ... 1.0. Order is 
+// protan, deutan, tritan.
+static const float machadoSRGB[3][11][9] = {
+  {{ 1.000000, 0.000000, 0.000000,  0.000000, 1.000000, 0.000000,  0.000000, 0.000000, 1.000000},
+   { 0.856167, 0.182038,-0.038205,  0.029342, 0.955115, 0.015544, -0.002880,-0.001563, 1.004443},
+   { 0.734766, 0.334872,-0.069637,  0.051840, 0.919198, 0.028963, -0.004928,-0.004209, 1.009137},
+   { 0.630323, 0.465641,-0.095964,  0.069181, 0.890046, 0.040773, -0.006308,-0.007724, 1.014032},
+   { 0.539009, 0.579343,-0.118352,  0.082546, 0.866121, 0.051332, -0.007136,-0.011959, 1.019095},
+   { 0.458064, 0.679578,-0.137642,  0.092785, 0.846313, 0.060902, -0.007494,-0.016807, 1.024301},
+   { 0.385450, 0.769005,-0.154455,  0.100526, 0.829802, 0.069673, -0.007442,-0.022190, 1.029632},
+   { 0.319627, 0.849633,-0.169261,  0.106241, 0.815969, 0.077790, -0.007025,-0.028051, 1.035076},
+   { 0.259411, 0.923008,-0.182420,  0.110296, 0.804340, 0.085364, -0.006276,-0.034346, 1.040622},
+   { 0.203876, 0.990338,-0.194214,  0.112975, 0.794542, 0.092483, -0.005222,-0.041043, 1.046265},
+   { 0.152286, 1.052583,-0.204868,  0.114503, 0.786281, 0.099216, -0.003882,-0.048116, 1.051998}},
+  {{ 1.000000, 0.000000, 0.000000,  0.000000, 1.000000, 0.000000,  0.000000, 0.000000, 1.000000},
+   { 0.866435, 0.177704,-0.044139,  0.049567, 0.939063, 0.011370, -0.003453, 0.007233, 0.996220},
+   { 0.760729, 0.319078,-0.079807,  0.090568, 0.889315, 0.020117, -0.006027, 0.013325, 0.992702},
+   { 0.675425, 0.433850,-0.109275,  0.125303, 0.847755, 0.026942, -0.007950, 0.018572, 0.989378},
+   { 0.605511, 0.528560,-0.134071,  0.155318, 0.812366, 0.032316, -0.009376, 0.023176, 0.986200},
+   { 0.547494, 0.607765,-0.155259,  0.181692, 0.781742, 0.036566, -0.010410, 0.027275, 0.983136},
+   { 0.498864, 0.674741,-0.173604,  0.205199, 0.754872, 0.039929, -0.011131, 0.030969, 0.980162},
+   { 0.457771, 0.731899,-0.189670,  0.226409, 0.731012, 0.042579, -0.011595, 0.034333, 0.977261},
+   { 0.422823, 0.781057,-0.203881,  0.245752, 0.709602, 0.044646, -0.011843, 0.037423, 0.974421},
+   { 0.392952, 0.823610,-0.216562,  0.263559, 0.690210, 0.046232, -0.011910, 0.040281, 0.971630},
+   { 0.367322, 0.860646,-0.227968,  0.280085, 0.672501, 0.047413, -0.011820, 0.042940, 0.968881}},
+  {{ 1.000000, 0.000000, 0.000000,  0.000000, 1.000000, 0.000000,  0.000000, 0.000000, 1.000000},
+   { 0.926670, 0.092514,-0.019184,  0.021191, 0.964503, 0.014306,  0.008437, 0.054813, 0.936750},
+   { 0.895720, 0.133330,-0.029050,  0.029997, 0.945400, 0.024603,  0.013027, 0.104707, 0.882266},
+   { 0.905871, 0.127791,-0.033662,  0.026856, 0.941251, 0.031893,  0.013410, 0.148296, 0.838294},
+   { 0.948035, 0.089490,-0.037526,  0.014364, 0.946792, 0.038844,  0.010853, 0.193991, 0.795156},
+   { 1.017277, 0.027029,-0.044306, -0.006113, 0.958479, 0.047634,  0.006379, 0.248708, 0.744913},
+   { 1.104996,-0.046633,-0.058363, -0.032137, 0.971635, 0.060503,  0.001336, 0.317922, 0.680742},
+   { 1.193214,-0.109812,-0.083402, -0.058496, 0.979410, 0.079086, -0.002346, 0.403492, 0.598854},
+   { 1.257728,-0.139648,-0.118081, -0.078003, 0.975409, 0.102594, -0.003316, 0.501214, 0.502102},
+   { 1.278864,-0.125333,-0.153531, -0.084748, 0.957674, 0.127074, -0.000989, 0.601151, 0.399838},
+   { 1.255528,-0.076749,-0.178779, -0.078411, 0.930809, 0.147602,  0.004733, 0.691367, 0.303900}}
+};
+
+// linear sRGB -> XYZ (D65) -> LMS (Smith & Pokorny), ie. the cone space 
+// the Machado matrices are taken through to reach our displays.
+static const double srgb2xyz[9] = { 0.4124, 0.3576, 0.1805,
+				    0.2126, 0.7152, 0.0722,
+				    0.0193, 0.1192, 0.9505 };
+static const double xyz2lms[9] = { 0.15514, 0.54312,-0.03286,
+				  -0.15514, 0.45684, 0.03286,
+				   0.00000, 0.00000, 0.00801 };
+
+static void mult3x3(const double a[9], const double b[9], double out[9]){
+  int i, j;
+  for (i=0; i<3; i++)
+    for (j=0; j<3; j++)
+      out[i*3+j] = a[i*3]*b[j] + a[i*3+1]*b[3+j] + a[i*3+2]*b[6+j];
+}
+
+static void invert3x3(const double m[9], double out[9]){
+  double det = m[0]*(m[4]*m[8]-m[5]*m[7]) - m[1]*(m[3]*m[8]-m[5]*m[6])
+             + m[2]*(m[3]*m[7]-m[4]*m[6]);
+  out[0] = (m[4]*m[8]-m[5]*m[7])/det;
+  out[1] = (m[2]*m[7]-m[1]*m[8])/det;
+  out[2] = (m[1]*m[5]-m[2]*m[4])/det;
+  out[3] = (m[5]*m[6]-m[3]*m[8])/det;
+  out[4] = (m[0]*m[8]-m[2]*m[6])/det;
+  out[5] = (m[2]*m[3]-m[0]*m[5])/det;
+  out[6] = (m[3]*m[7]-m[4]*m[6])/det;
+  out[7] = (m[1]*m[6]-m[0]*m[7])/det;
+  out[8] = (m[0]*m[4]-m[1]*m[3])/det;
+}
+
+void displayDevice::computeAnomalousBank(){
+  // Each Machado matrix M is a color operator in sRGB. We carry it into 
+  // cone space (C*M*inv(C), C = srgb->lms), then over to this display by 
+  // von Kries scaling the cones so the sRGB white lands on the display 
+  // white (D), and finally prepend the display's rgb2lms. So each bank 
+  // entry is rgb straight to the anomalous observer's lms, same as 
+  // computeVienotTransform, and severity 0 is just rgb2lms.
+  double c[9], cInv[9], d[9], dInv[9], r[9], m[9], t1[9], t2[9];
+  int type, s, i;
+
+  mult3x3(xyz2lms, srgb2xyz, c);
+  invert3x3(c, cInv);
+  for (i=0; i<9; i++){
+    d[i] = dInv[i] = 0.0;
+    r[i] = rgb2lms[i];
+  }
+  for (i=0; i<3; i++){
+    d[i*4] = (r[i*3]+r[i*3+1]+r[i*3+2])/(c[i*3]+c[i*3+1]+c[i*3+2]);
+    dInv[i*4] = 1.0/d[i*4];
+  }
+
+  for (type=0; type<3; type++){
+    for (s=0; s<11; s++){
+      for (i=0; i<9; i++) m[i] = machadoSRGB[type][s][i];
+      mult3x3(m, cInv, t1);	// M*inv(C)
+      mult3x3(c, t1, t2);	// C*M*inv(C)
+      mult3x3(t2, dInv, t1);
+      mult3x3(d, t1, t2);	// D*C*M*inv(C)*inv(D)
+      mult3x3(t2, r, t1);	// ... *rgb2lms
+      for (i=0; i<9; i++) anomalousBank[(type*11+s)*9+i] = t1[i];
+    }
+  }
+  anomalousBankValid = 1;
+}
+
+void displayDevice::computeAnomalousTransform(char viewerType, float severity, 
+					      float out[9]){
+  // Anomalous trichromat simulation (protanomaly, deuteranomaly, 
+  // tritanomaly) for any severity in [0,1]: linear interpolation between 
+  // the two nearest of the 11 precomputed matrices. Like 
+  // computeVienotTransform, out takes rgb to (the anomalous viewer's) lms.
+  // Anything but 'p', 'd' or 't' gets plain rgb2lms.
+  float *lo, *hi, f;
+  int type, s, i;
+
+  if (viewerType=='p') type = 0;
+  else if (viewerType=='d') type = 1;
+  else if (viewerType=='t') type = 2;
+  else{
+    for (i=0; i<9; i++) out[i] = rgb2lms[i];
+    return;
+  }
+  if (!anomalousBankValid) computeAnomalousBank();
+
+  if (severity<0.0) severity = 0.0;
+  if (severity>1.0) severity = 1.0;
+  s = (int)(severity*10.0);
+  if (s>9) s = 9;
+  f = severity*10.0 - s;
+  lo = anomalousBank+(type*11+s)*9;
+  hi = lo+9;
+  for (i=0; i<9; i++) out[i] = lo[i] + f*(hi[i]-lo[i]);
+}
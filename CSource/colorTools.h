@@ -22,6 +22,18 @@ private:
 	int numGammaSamples;
 	char displayFilename[64];
 
+	// gamma folded into a color transform, for 8-bit input (see getInputTables)
+	float inputTables[9*256];
+	float inputTablesXform[9];
+	float inputTablesScale;
+	int inputTablesValid;
+
+	// per-display anomalous trichromat matrices, 11 severities per 
+	// protan/deutan/tritan (see computeAnomalousTransform)
+	float anomalousBank[3*11*9];
+	int anomalousBankValid;
+	void computeAnomalousBank();
+
 	void init();
 	void readDeviceFile(const char *fname);
 	void computeOpponentTransforms();
@@ -50,6 +62,11 @@ public:
 	float *invGammaPtrG() {return invgammaG;}
 	float *invGammaPtrB() {return invgammaB;}
 
+	float *getInputTables(float tm[], float scale);
+	void getInputTablesFixed(const double tm[], int rows, float scale, int fracBits, int out[]);
+	void computeVienotTransform(char viewerType, float out[9]);
+	void computeAnomalousTransform(char viewerType, float severity, float out[9]);
+
 	float *getRGB2LMS() {return rgb2lms;}
 	float *getLMS2RGB() {return lms2rgb;}
 	float *getLMS2OPP() {return lms2opp;}
@@ -0,0 +1,307 @@
+#include "fftplan.h"
+#include "bufpool.h"
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include <iostream>
+
+struct planEntry {
+  int n0, n1, howmany, direction, alignment, threads;
+  unsigned rigor;
+  fftwf_plan plan;
+  planEntry *next;
+};
+
+struct sizeEntry {
+  int n, maxPrime, size;
+  sizeEntry *next;
+};
+
+// 1-D transforms timed at a time by the measured size mode
+#define FFT_SIZE_LINES 16
+
+static planEntry *plans = NULL;
+static sizeEntry *sizes = NULL;
+static int sizeMaxPrime = 7, sizeMeasured = 0;
+static unsigned planRigor = FFTW_ESTIMATE;
+static int planThreads = 1;
+static int threadsReady = 0;
+static fftPlanStats stats;
+static pthread_mutex_t planLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Floats per transform
+static size_t transformFloats(int n0, int n1, int direction)
+{
+  if (direction==DCT_FORWARD || direction==DCT_BACKWARD) return (size_t)n0*n1;
+  return (size_t)n0*2*(n1/2+1);
+}
+
+static fftwf_plan makePlan(int n0, int n1, int howmany, int direction, float *s, unsigned flags)
+{
+  int n[2], dist = transformFloats(n0, n1, direction);
+
+  n[0] = n0;
+  n[1] = n1;
+  if (direction==DCT_FORWARD || direction==DCT_BACKWARD){
+    fftwf_r2r_kind k = (direction==DCT_FORWARD) ? FFTW_REDFT10 : FFTW_REDFT01, kind[2] = {k, k};
+    return fftwf_plan_many_r2r(2, n, howmany, s, NULL, 1, dist, s, NULL, 1, dist, kind, flags);
+  }
+  if (direction==FFTW_FORWARD)
+    return fftwf_plan_many_dft_r2c(2, n, howmany, s, NULL, 1, dist,
+				   (fftwf_complex *)s, NULL, 1, dist/2, flags);
+  return fftwf_plan_many_dft_c2r(2, n, howmany, (fftwf_complex *)s, NULL, 1, dist/2,
+				 s, NULL, 1, dist, flags);
+}
+
+fftwf_plan fftPlan(int n0, int n1, int howmany, int direction, float *buf)
+{
+  int alignment = fftwf_alignment_of(buf);
+  planEntry *e;
+  fftwf_plan plan;
+
+  pthread_mutex_lock(&planLock);
+  for (e=plans; e; e=e->next){
+    if (e->n0==n0 && e->n1==n1 && e->howmany==howmany && e->direction==direction &&
+	e->alignment==alignment && e->rigor==planRigor && e->threads==planThreads){
+      stats.planHits++;
+      pthread_mutex_unlock(&planLock);
+      return e->plan;
+    }
+  }
+
+  // FFTW_ESTIMATE and FFTW_WISDOM_ONLY leave the arrays alone, so those can
+  // plan on buf itself. Otherwise plan on scratch with the same alignment.
+  clock_t start = clock();
+  if (threadsReady) fftwf_plan_with_nthreads(planThreads);
+  if (planRigor==FFTW_ESTIMATE)
+    plan = makePlan(n0, n1, howmany, direction, buf, planRigor);
+  else
+    plan = makePlan(n0, n1, howmany, direction, buf, planRigor | FFTW_WISDOM_ONLY);
+  if (plan==NULL){
+    float *scratch = poolAllocFloat(transformFloats(n0, n1, direction)*howmany + POOL_ALIGN/sizeof(float));
+    plan = makePlan(n0, n1, howmany, direction, scratch + alignment/sizeof(float), planRigor);
+    poolFree(scratch);
+  }
+  if (plan==NULL){
+    std::cerr << "can't create plan - error !!!" << std::endl;
+    exit(1);
+  }
+
+  e = new planEntry;
+  e->n0 = n0; e->n1 = n1; e->howmany = howmany; e->direction = direction;
+  e->alignment = alignment; e->rigor = planRigor; e->threads = planThreads;
+  e->plan = plan;
+  e->next = plans;
+  plans = e;
+  stats.plansMade++;
+  stats.planSecs += (double)(clock()-start)/CLOCKS_PER_SEC;
+  pthread_mutex_unlock(&planLock);
+  return plan;
+}
+
+void fftExecute(fftwf_plan plan, int direction, float *buf)
+{
+  if (direction==DCT_FORWARD || direction==DCT_BACKWARD)
+    fftwf_execute_r2r(plan, buf, buf);
+  else if (direction==FFTW_FORWARD)
+    fftwf_execute_dft_r2c(plan, buf, (fftwf_complex *)buf);
+  else
+    fftwf_execute_dft_c2r(plan, (fftwf_complex *)buf, buf);
+}
+
+void fftRun(int n0, int n1, int howmany, int direction, float *buf)
+{
+  int i;
+  size_t dist = transformFloats(n0, n1, direction);
+  fftwf_plan plan;
+
+  // FFTW threads a batch by giving each thread whole transforms, which
+  // leaves threads idle unless they divide the batch evenly. Otherwise run
+  // the transforms one at a time, each split across all the threads.
+  if (planThreads>1 && howmany%planThreads!=0){
+    for (i=0; i<howmany; i++){
+      plan = fftPlan(n0, n1, 1, direction, buf+i*dist);
+      fftExecute(plan, direction, buf+i*dist);
+    }
+    return;
+  }
+  plan = fftPlan(n0, n1, howmany, direction, buf);
+  fftExecute(plan, direction, buf);
+}
+
+int fftSmoothSize(int n, int maxPrime)
+{
+  static const int primes[6] = {2, 3, 5, 7, 11, 13};
+  int m, k, i;
+
+  if (n < 1) n = 1;
+  for (m=n; ; m++){
+    k = m;
+    for (i=0; i<6 && primes[i]<=maxPrime; i++)
+      while (k%primes[i]==0) k /= primes[i];
+    if (k==1) return m;
+  }
+}
+
+// Seconds per line for a batch of 1-D real transforms of m, planned at the
+// rigor the real ones will be. planLock is held.
+static double timeLines(int m)
+{
+  int i, j, reps, dist = 2*(m/2+1);
+  float *buf = poolAllocFloat((size_t)dist*FFT_SIZE_LINES);
+  double best = 1e30, secs;
+  fftwf_plan plan;
+  clock_t start;
+
+  if (threadsReady) fftwf_plan_with_nthreads(1);
+  plan = fftwf_plan_many_dft_r2c(1, &m, FFT_SIZE_LINES, buf, NULL, 1, dist,
+				 (fftwf_complex *)buf, NULL, 1, dist/2, planRigor);
+  for (i=0; i<dist*FFT_SIZE_LINES; i++) buf[i] = (float)(i%7);
+  // the best of three runs of at least a couple of ms each
+  for (reps=1; ; reps*=2){
+    start = clock();
+    for (i=0; i<reps; i++) fftwf_execute(plan);
+    secs = (double)(clock()-start)/CLOCKS_PER_SEC;
+    if (secs > 0.002) break;
+  }
+  for (i=0; i<3; i++){
+    start = clock();
+    for (j=0; j<reps; j++) fftwf_execute(plan);
+    secs = (double)(clock()-start)/CLOCKS_PER_SEC;
+    if (secs < best) best = secs;
+  }
+  fftwf_destroy_plan(plan);
+  poolFree(buf);
+  return best/reps/FFT_SIZE_LINES;
+}
+
+// The smooth size from n up to FFT_SIZE_SLACK past the first that makes
+// the 2-D transform cheapest. That's this dimension's lines, plus m times
+// the other dimension's per-sample cost (taken to be like this one's at
+// the first smooth size, since it isn't known here). planLock is held.
+static int measureSize(int n, int maxPrime)
+{
+  int m0 = fftSmoothSize(n, maxPrime), m, best = m0;
+  double perSample, cost, bestCost;
+  clock_t start = clock();
+
+  bestCost = timeLines(m0);
+  perSample = bestCost/m0;
+  bestCost += m0*perSample;
+  for (m=fftSmoothSize(m0+1, maxPrime); m <= m0*(1.0+FFT_SIZE_SLACK); 
+       m=fftSmoothSize(m+1, maxPrime)){
+    cost = timeLines(m) + m*perSample;
+    if (cost < bestCost){
+      bestCost = cost;
+      best = m;
+    }
+  }
+  stats.sizesMeasured++;
+  stats.sizeSecs += (double)(clock()-start)/CLOCKS_PER_SEC;
+  return best;
+}
+
+int fftGoodSize(int n)
+{
+  sizeEntry *e;
+  int size;
+
+  if (!sizeMeasured) return fftSmoothSize(n, sizeMaxPrime);
+  pthread_mutex_lock(&planLock);
+  for (e=sizes; e; e=e->next){
+    if (e->n==n && e->maxPrime==sizeMaxPrime){
+      size = e->size;
+      pthread_mutex_unlock(&planLock);
+      return size;
+    }
+  }
+  size = measureSize(n, sizeMaxPrime);
+  e = new sizeEntry;
+  e->n = n; e->maxPrime = sizeMaxPrime; e->size = size;
+  e->next = sizes;
+  sizes = e;
+  pthread_mutex_unlock(&planLock);
+  return size;
+}
+
+void fftSetSizeMode(int maxPrime, int measured)
+{
+  sizeMaxPrime = maxPrime;
+  sizeMeasured = measured;
+}
+
+void fftSetThreads(int n)
+{
+  pthread_mutex_lock(&planLock);
+  if (n>1 && !threadsReady) threadsReady = fftwf_init_threads();
+  planThreads = (n>1 && threadsReady) ? n : 1;
+  pthread_mutex_unlock(&planLock);
+}
+
+int fftGetThreads()
+{
+  return planThreads;
+}
+
+void fftSetRigor(unsigned rigor)
+{
+  planRigor = rigor;
+}
+
+unsigned fftGetRigor()
+{
+  return planRigor;
+}
+
+int fftLoadWisdom(const char *fileName)
+{
+  int ok;
+  pthread_mutex_lock(&planLock);
+  ok = fftwf_import_wisdom_from_filename(fileName);
+  pthread_mutex_unlock(&planLock);
+  return ok;
+}
+
+int fftSaveWisdom(const char *fileName)
+{
+  int ok;
+  pthread_mutex_lock(&planLock);
+  ok = fftwf_export_wisdom_to_filename(fileName);
+  pthread_mutex_unlock(&planLock);
+  return ok;
+}
+
+void fftGetPlanStats(fftPlanStats &s)
+{
+  pthread_mutex_lock(&planLock);
+  s = stats;
+  pthread_mutex_unlock(&planLock);
+}
+
+void fftPrintPlanStats()
+{
+  fftPlanStats s;
+  fftGetPlanStats(s);
+  std::cerr << "fft plans: " << s.plansMade << " made (" << s.planSecs*1000.0 << " ms), "
+	    << s.planHits << " reused" << std::endl;
+  if (s.sizesMeasured)
+    std::cerr << "fft sizes: " << s.sizesMeasured << " measured (" << s.sizeSecs*1000.0 
+	      << " ms)" << std::endl;
+}
+
+void fftForgetPlans()
+{
+  pthread_mutex_lock(&planLock);
+  while (plans){
+    planEntry *e = plans;
+    plans = e->next;
+    fftwf_destroy_plan(e->plan);
+    delete e;
+  }
+  while (sizes){
+    sizeEntry *e = sizes;
+    sizes = e->next;
+    delete e;
+  }
+  pthread_mutex_unlock(&planLock);
+}
@@ -0,0 +1,83 @@
+#ifndef __fftplan_h
+#define __fftplan_h
+
+/*
+ *    FFTW plan cache.
+ *
+ *    img::doFFT and kernelSep::setKernFFT used to make (and throw away) a
+ *    new FFTW_ESTIMATE plan on every call. fftPlan keeps each plan, keyed
+ *    by the transform size, howmany, direction, the buffer's SIMD
+ *    alignment and the planner rigor, and hands it back the next time.
+ *
+ *    All the transforms here are in place, real<->half-complex, 2-D
+ *    (n0 x n1, with n1 padded to 2*(n1/2+1) floats), with howmany of them
+ *    packed back to back. The DCT_ directions are the real-to-real 2-D
+ *    DCT-II (REDFT10) and DCT-III (REDFT01), n0 x n1 floats each with no
+ *    padding; one after the other they scale by 4*n0*n1. Plans that have to measure are made on a scratch
+ *    buffer, so FFTW_MEASURE or FFTW_PATIENT never clobbers the caller's data,
+ *    and are run with fftExecute on whatever buffer (of the same
+ *    alignment) the caller has.
+ *
+ *    The rigor is FFTW_ESTIMATE unless fftSetRigor says otherwise. The
+ *    slower ones are worth it with a wisdom file: fftLoadWisdom at start-up
+ *    and fftSaveWisdom at shut-down, so only the first run pays for the
+ *    planning.
+ *
+ *    fftSetThreads(n) plans with FFTW's threads. fftRun then keeps all n
+ *    busy on a batch: if they don't divide howmany evenly, it runs the
+ *    transforms one after the other, each on all n threads.
+ *
+ *    fftGoodSize rounds a padded dimension up to a size FFTW is quick at:
+ *    the next one whose only prime factors are 2, 3, 5 and 7 (optionally
+ *    11 and 13 as well). In the measured mode it times 1-D transforms of
+ *    the smooth sizes from there up to FFT_SIZE_SLACK further, and takes
+ *    whichever makes the 2-D transform cheapest on this machine.
+ *
+ *    Planning is serialized (FFTW's planner isn't thread safe); execution
+ *    isn't.
+ */
+
+#include <fftw3.h>
+
+#define FFT_WISDOM_FILE "FFT_wisdom.pln"
+
+// How far past the smallest smooth size the measured mode looks
+#define FFT_SIZE_SLACK 0.15
+
+// Directions besides FFTW_FORWARD and FFTW_BACKWARD
+#define DCT_FORWARD 2		// REDFT10 both ways
+#define DCT_BACKWARD 3		// REDFT01
+
+fftwf_plan fftPlan(int n0, int n1, int howmany, int direction, float *buf);
+void fftExecute(fftwf_plan plan, int direction, float *buf);
+// Plan (or look up) and run howmany transforms packed in buf
+void fftRun(int n0, int n1, int howmany, int direction, float *buf);
+
+void fftSetThreads(int n);	// threads per transform (default 1)
+int fftGetThreads();
+void fftSetRigor(unsigned rigor);	// FFTW_ESTIMATE, FFTW_MEASURE or FFTW_PATIENT
+unsigned fftGetRigor();
+int fftLoadWisdom(const char *fileName);	// 1 if it was read
+int fftSaveWisdom(const char *fileName);
+
+// Smallest size >= n with no prime factor above maxPrime (7, 11 or 13)
+int fftSmoothSize(int n, int maxPrime);
+// A good transform size for at least n samples: fftSmoothSize, or the
+// measured choice (the first call for each n times it; later ones reuse it)
+int fftGoodSize(int n);
+void fftSetSizeMode(int maxPrime, int measured);	// default 7, not measured
+
+struct fftPlanStats {
+  int plansMade;	// cache misses
+  int planHits;
+  double planSecs;	// CPU time spent in the planner
+  int sizesMeasured;	// by fftGoodSize
+  double sizeSecs;
+};
+void fftGetPlanStats(fftPlanStats &s);
+void fftPrintPlanStats();	// to cerr
+
+// Destroy the cached plans (and forget the measured sizes)
+void fftForgetPlans();
+
+#endif // __fftplan_h
@@ -0,0 +1,264 @@
+#include "iirgauss.h"
+#include "bufpool.h"
+#include <math.h>
+#include <complex>
+
+// Lines filtered side by side; the recursions are vectorized across them
+#define IIR_LANES 32
+// A section's starting state is followed in until it has decayed this far
+#define IIR_TAIL_EPS 1e-10
+
+// Deriche's fit of exp(-x^2/2) for x >= 0, two damped cosines:
+//   sum over k of (a_k*cos(w_k*x) + b_k*sin(w_k*x)) * exp(-l_k*x)
+// as {a_k, b_k, l_k, w_k}
+static const double DERICHE[2][4] = {{1.680, 3.735, 1.783, 0.6318},
+				     {-0.6803, -0.2598, 1.723, 1.997}};
+
+// Sum over the integers of exp(-d^2/(2 sd^2)), ie. of the sampled kernel
+// that setKernFFT builds
+static double sampledSum(double sd)
+{
+  double s = 1.0;
+  int d;
+  if (sd >= 2.0) return 2.506628274631*sd;	// sqrt(2*pi)*sd, to many digits
+  for (d=1; d<=20; d++) s += 2.0*exp(-d*d/(2.0*sd*sd));
+  return s;
+}
+
+void gaussSum::setKern(float kW1, float kSD1, float kW2, float kSD2, float kW3, float kSD3, float scale)
+{
+  float kW[3] = {kW1, kW2, kW3}, kSD[3] = {kSD1, kSD2, kSD3};
+  double area[3], total = 0.0;
+  int i;
+
+  // setKernFFT weights term i by kW/SD, samples it and scales the lot to
+  // sum to scale. Here each term is a unit-area filter, so its weight is
+  // its share of that sum.
+  n = 0;
+  level = 0;
+  for (i=0; i<3; i++){
+    if (kSD[i]==0.0) kSD[i] = 0.001;	// as setKernFFT
+    area[i] = kW[i]/kSD[i]*sampledSum(kSD[i]);
+    total += area[i];
+  }
+  total = fabs(total);
+  if (total==0.0) total = 1.0;
+  for (i=0; i<3; i++){
+    if (kW[i]==0.0) continue;
+    weight[n] = scale*area[i]/total;
+    sd[n] = kSD[i];
+    how[n] = (kSD[i] < IIR_MIN_SD) ? TERM_DIRECT : TERM_RECURSIVE;
+    n++;
+  }
+}
+
+double offCentreShare(double sd)
+{
+  return 1.0 - 1.0/sampledSum(sd);
+}
+
+// How far in a state's effect lasts, at most n
+static int tailLength(double absPole, int n)
+{
+  double k = ceil(log(IIR_TAIL_EPS)/log(absPole));
+  return (k < n) ? (int)k : n;
+}
+
+int recursiveTail(double sd, int n)
+{
+  // the slower of the two sections
+  return tailLength(exp(-DERICHE[1][2]/sd), n);
+}
+
+// Add a*(the Gaussian of SD sd) applied to buf (n samples of L lanes) into
+// acc. Sampled at x = m/sd, Deriche's fit is the real part of
+// sum c_k*z_k^m, with c_k = a_k - i*b_k and z_k = exp((-l_k + i*w_k)/sd),
+// so each side of the kernel is two complex first-order sections,
+// v[m] = z*v[m-1] + x[m]. The causal side (m >= 0) and the anticausal side
+// (m <= 0, less the shared centre tap) are summed.
+static void derichePass(const float *buf, int n, int L, double sd, double a, float *acc)
+{
+  std::complex<double> z[2], c[2], sum = 0.0;
+  float zr[2], zi[2], cr[2], ci[2], h0, t;
+  float vr[2][IIR_LANES], vi[2][IIR_LANES], ur[2][IIR_LANES], ui[2][IIR_LANES];
+  int k, m, l;
+
+  for (k=0; k<2; k++){
+    z[k] = std::exp(std::complex<double>(-DERICHE[k][2], DERICHE[k][3])/sd);
+    c[k] = std::complex<double>(DERICHE[k][0], -DERICHE[k][1]);
+    sum += c[k]/(1.0-z[k]);
+  }
+  // scale to unit area (times a): both sides, the centre counted once
+  double norm = a/(2.0*sum.real() - (DERICHE[0][0]+DERICHE[1][0]));
+  for (k=0; k<2; k++){
+    zr[k] = z[k].real(); zi[k] = z[k].imag();
+    cr[k] = c[k].real()*norm; ci[k] = c[k].imag()*norm;
+  }
+  h0 = (DERICHE[0][0]+DERICHE[1][0])*norm;
+
+  // Both sides from a zero state first...
+  for (k=0; k<2; k++)
+    for (l=0; l<L; l++) vr[k][l] = vi[k][l] = ur[k][l] = ui[k][l] = 0.0;
+  for (m=0; m<n; m++){
+    const float *x = buf + (long)m*L;
+    float *y = acc + (long)m*L;
+    for (l=0; l<L; l++){
+      t = zr[0]*vr[0][l] - zi[0]*vi[0][l] + x[l];
+      vi[0][l] = zr[0]*vi[0][l] + zi[0]*vr[0][l];
+      vr[0][l] = t;
+      t = zr[1]*vr[1][l] - zi[1]*vi[1][l] + x[l];
+      vi[1][l] = zr[1]*vi[1][l] + zi[1]*vr[1][l];
+      vr[1][l] = t;
+      y[l] += cr[0]*vr[0][l] - ci[0]*vi[0][l] + cr[1]*vr[1][l] - ci[1]*vi[1][l] - h0*x[l];
+    }
+  }
+  for (m=n-1; m>=0; m--){
+    const float *x = buf + (long)m*L;
+    float *y = acc + (long)m*L;
+    for (l=0; l<L; l++){
+      t = zr[0]*ur[0][l] - zi[0]*ui[0][l] + x[l];
+      ui[0][l] = zr[0]*ui[0][l] + zi[0]*ur[0][l];
+      ur[0][l] = t;
+      t = zr[1]*ur[1][l] - zi[1]*ui[1][l] + x[l];
+      ui[1][l] = zr[1]*ui[1][l] + zi[1]*ur[1][l];
+      ur[1][l] = t;
+      y[l] += cr[0]*ur[0][l] - ci[0]*ui[0][l] + cr[1]*ur[1][l] - ci[1]*ui[1][l];
+    }
+  }
+
+  // ...then add what the states coming in over the mirrored edges should
+  // have been. Going round the period (the line, then its mirror image),
+  // with A = the causal run's end state and B = the anticausal one's:
+  //   causal state before 0   = (B + z^n*A)/(1 - z^2n)
+  //   anticausal state past n-1 = (A + z^n*B)/(1 - z^2n)
+  // and each one's effect on sample m decays like z^(distance in). That's
+  // exact, whatever the SD.
+  for (k=0; k<2; k++){
+    std::complex<double> zn = std::pow(z[k], n), f = 1.0/(1.0-zn*zn);
+    float fr = f.real(), fi = f.imag(), znr = zn.real(), zni = zn.imag();
+    float sr[IIR_LANES], si[IIR_LANES], wr, wi;
+    int K = tailLength(std::abs(z[k]), n);
+
+    // causal: in[l] = f*(B + zn*A), then times z for each step in
+    for (l=0; l<L; l++){
+      wr = ur[k][l] + znr*vr[k][l] - zni*vi[k][l];
+      wi = ui[k][l] + znr*vi[k][l] + zni*vr[k][l];
+      sr[l] = fr*wr - fi*wi;
+      si[l] = fr*wi + fi*wr;
+    }
+    for (m=0; m<K; m++){
+      float *y = acc + (long)m*L;
+      for (l=0; l<L; l++){
+	t = zr[k]*sr[l] - zi[k]*si[l];
+	si[l] = zr[k]*si[l] + zi[k]*sr[l];
+	sr[l] = t;
+	y[l] += cr[k]*sr[l] - ci[k]*si[l];
+      }
+    }
+    // anticausal: f*(A + zn*B)
+    for (l=0; l<L; l++){
+      wr = vr[k][l] + znr*ur[k][l] - zni*ui[k][l];
+      wi = vi[k][l] + znr*ui[k][l] + zni*ur[k][l];
+      sr[l] = fr*wr - fi*wi;
+      si[l] = fr*wi + fi*wr;
+    }
+    for (m=n-1; m>=n-K; m--){
+      float *y = acc + (long)m*L;
+      for (l=0; l<L; l++){
+	t = zr[k]*sr[l] - zi[k]*si[l];
+	si[l] = zr[k]*si[l] + zi[k]*sr[l];
+	sr[l] = t;
+	y[l] += cr[k]*sr[l] - ci[k]*si[l];
+      }
+    }
+  }
+}
+
+// Blur L lines of n samples in place. Sample m of line l is at
+// data[m*sampleStride + l*laneStride]. buf and acc hold n*L.
+static void blurLanes(float *data, int n, long sampleStride, long laneStride, int L,
+		      const gaussSum &k, float *buf, float *acc)
+{
+  int i, m, l, t;
+
+  for (m=0; m<n; m++){
+    for (l=0; l<L; l++)
+      buf[(long)m*L+l] = data[m*sampleStride + l*laneStride];
+  }
+  for (m=0; m<n*L; m++) acc[m] = 0.0;
+
+  for (i=0; i<k.n; i++){
+    float a = k.weight[i];
+    double sd = k.sd[i];
+
+    if (k.how[i]==TERM_DELTA){
+      for (m=0; m<n*L; m++) acc[m] += a*buf[m];
+    }else if (sd >= 2.0*n){
+      // Wider than the period: all that's left is the mean
+      float mean[IIR_LANES];
+      for (l=0; l<L; l++) mean[l] = 0.0;
+      for (m=0; m<n; m++)
+	for (l=0; l<L; l++) mean[l] += buf[(long)m*L+l];
+      for (l=0; l<L; l++) mean[l] *= a/n;
+      for (m=0; m<n; m++)
+	for (l=0; l<L; l++) acc[(long)m*L+l] += mean[l];
+    }else if (k.how[i]==TERM_DIRECT){
+      // Direct: the sampled Gaussian out to 4 SD
+      int R = (int)ceil(4.0*sd);
+      float h[DIRECT_MAX_RADIUS+1], hSum = 1.0;
+      if (R > DIRECT_MAX_RADIUS) R = DIRECT_MAX_RADIUS;
+      h[0] = 1.0;
+      for (t=1; t<=R; t++){
+	h[t] = exp(-t*t/(2.0*sd*sd));
+	hSum += 2.0*h[t];
+      }
+      for (t=0; t<=R; t++) h[t] *= a/hSum;
+      for (m=0; m<n; m++){
+	float *y = acc + (long)m*L, *x = buf + (long)m*L;
+	for (l=0; l<L; l++) y[l] += h[0]*x[l];
+	for (t=1; t<=R; t++){
+	  int m1 = (m+t < n) ? m+t : mirrorIndex(m+t, n), m2 = (m-t >= 0) ? m-t : mirrorIndex(m-t, n);
+	  float *x1 = buf + (long)m1*L, *x2 = buf + (long)m2*L;
+	  for (l=0; l<L; l++) y[l] += h[t]*(x1[l]+x2[l]);
+	}
+      }
+    }else{
+      derichePass(buf, n, L, sd, a, acc);
+    }
+  }
+
+  for (m=0; m<n; m++){
+    for (l=0; l<L; l++)
+      data[m*sampleStride + l*laneStride] = acc[(long)m*L+l];
+  }
+}
+
+void gaussBlurPlane(float *plane, int width, int height, long pitch, const gaussSum &k)
+{
+  int n = (width > height) ? width : height, i;
+  long j;
+
+  // Nothing but deltas: just a gain
+  float gain = 0.0;
+  for (i=0; i<k.n && k.how[i]==TERM_DELTA; i++) gain += k.weight[i];
+  if (i==k.n){
+    for (i=0; i<height; i++)
+      for (j=0; j<width; j++) plane[i*pitch+j] *= gain;
+    return;
+  }
+
+  float *buf = poolAllocFloat((long)n*IIR_LANES*2);
+  float *acc = buf + (long)n*IIR_LANES;
+
+  // Along the lines: a strip of lines at a time, transposed into buf
+  for (i=0; i<height; i+=IIR_LANES){
+    int L = (height-i < IIR_LANES) ? height-i : IIR_LANES;
+    blurLanes(plane + i*pitch, width, 1, pitch, L, k, buf, acc);
+  }
+  // Down the columns: a strip of neighbouring columns at a time
+  for (i=0; i<width; i+=IIR_LANES){
+    int L = (width-i < IIR_LANES) ? width-i : IIR_LANES;
+    blurLanes(plane + i, height, pitch, 1, L, k, buf, acc);
+  }
+  poolFree(buf);
+}
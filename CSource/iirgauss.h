@@ -0,0 +1,65 @@
+#ifndef __iirgauss_h
+#define __iirgauss_h
+
+/*
+ *    Recursive (IIR) Gaussian blur.
+ *
+ *    An alternative to the padded FFT convolution for the opponent-channel
+ *    kernels. Each Gaussian term is Deriche's (1993) 4th-order recursive
+ *    approximation (within 0.05% of the peak from SD 1 up), run as complex
+ *    first-order sections forwards and backwards over each line, so it
+ *    costs the same per pixel whatever the SD.
+ *
+ *    The image is treated as mirrored at its edges (half-sample symmetric).
+ *    Each section's starting state is solved for that periodic signal,
+ *    so the mirror boundary is exact, not just a padded approximation.
+ *
+ *    Each term is applied one of three ways (gaussSum::how): as a delta
+ *    (too narrow to matter), as a short direct filter, or recursively.
+ *    The recursive approximation is poor below IIR_MIN_SD pixels, so
+ *    setKern picks direct there; spatialplan.h can trade the two off by
+ *    cost. Terms wider than twice the line length come out as the line's
+ *    mean however they're marked.
+ */
+
+#define GAUSS_MAX_TERMS 3
+#define IIR_MIN_SD 1.0
+// The direct filter goes out to 4 SD, but no further than this
+#define DIRECT_MAX_RADIUS 32
+
+enum gaussTermMethod {TERM_DELTA, TERM_DIRECT, TERM_RECURSIVE};
+
+// One channel's 1-D kernel, a weighted sum of Gaussians (SDs in pixels).
+// Like kernelSep, it's applied along the rows and then down the columns.
+struct gaussSum {
+  int n;
+  float weight[GAUSS_MAX_TERMS];	// of unit-area Gaussians
+  float sd[GAUSS_MAX_TERMS];
+  gaussTermMethod how[GAUSS_MAX_TERMS];
+  int level;		// pyramid level to filter at, 0 = full resolution (pyramid.h)
+
+  gaussSum() : n(0), level(0) {}
+  // Same arguments, and the same normalization (the whole kernel sums to
+  // scale), as kernelSep::setKernFFT
+  void setKern(float kW1, float kSD1, float kW2, float kSD2, float kW3, float kSD3, float scale);
+};
+
+// Share of a sampled Gaussian's weight off its centre tap
+double offCentreShare(double sd);
+
+// How many samples into a line of n a recursive term's edge state reaches
+int recursiveTail(double sd, int n);
+
+// Sample i of a line of n mirrored at its ends (half-sample symmetric)
+inline int mirrorIndex(int i, int n)
+{
+  i %= 2*n;
+  if (i < 0) i += 2*n;
+  return (i < n) ? i : 2*n-1-i;
+}
+
+// Blur a plane of height lines of width floats in place; each line 
+// starts pitch floats after the last
+void gaussBlurPlane(float *plane, int width, int height, long pitch, const gaussSum &k);
+
+#endif // __iirgauss_h
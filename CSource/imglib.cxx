@@ -1,10 +1,19 @@
 #include "imglib.h"
 #include "kernlib.h"
 #include "colorTools.h"
+#include "bufpool.h"
+#include "fftplan.h"
+#include "iirgauss.h"
+#include "pyramid.h"
+#include "kernspec.h"
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
 #include <iostream>
 #include <fftw3.h>
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
 #include "jama/tnt_array1d.h"
 #include "jama/tnt_array2d.h"
 #include "jama/tnt_array1d_utils.h"
@@ -19,12 +28,17 @@ img::img(int rows, int cols)
   fourierRows = 0;
   fourierCols = 0;
   nFourierPix = 0;
+  padRows = padCols = -1;
   FFT_MEMORY_ALLOCATED = 0;
+  fftBorrowed = 0;
   colorSpaceLabel = RGB;
+  hasPendingXform = 0;
+  planeStorage = FLOAT32;
+  red16 = green16 = blue16 = NULL;
 
   // Allocate one big block of memory, then divy it up ourselves.
   // (makes processor caching more effective? seems to provide ~ 20% speed gain.)
-  red = new float [npix*3];
+  red = poolAllocFloat(npix*3);
   green = red+npix;
   blue = green+npix;
 
@@ -50,10 +64,15 @@ img::img(int rows, int cols, float maxImageValue)
   fourierRows = 0;
   fourierCols = 0;
   nFourierPix = 0;
+  padRows = padCols = -1;
   FFT_MEMORY_ALLOCATED = 0;
+  fftBorrowed = 0;
   colorSpaceLabel = RGB;
+  hasPendingXform = 0;
+  planeStorage = FLOAT32;
+  red16 = green16 = blue16 = NULL;
 
-  red = new float [npix*3];
+  red = poolAllocFloat(npix*3);
   green = red+npix;
   blue = green+npix;
 
@@ -75,12 +94,17 @@ img::img(int rows, int cols, int hasFFT)
   fourierRows = 0;
   fourierCols = 0;
   nFourierPix = 0;
+  padRows = padCols = -1;
   FFT_MEMORY_ALLOCATED = 0;
+  fftBorrowed = 0;
   colorSpaceLabel = RGB;
+  hasPendingXform = 0;
+  planeStorage = FLOAT32;
+  red16 = green16 = blue16 = NULL;
 	
   // Allocate one big block of memory, then divy it up ourselves.
   // (makes processor caching more effective? seems to provide ~ 20% speed gain.)
-  red = new float [npix*3];
+  red = poolAllocFloat(npix*3);
   green = red+npix;
   blue = green+npix;
 	
@@ -91,58 +115,64 @@ img::img(int rows, int cols, int hasFFT)
   return;
 }
 
-int img::allocateFFTspace(){
-  // Allocate memory for a forward real FFT. 
+void img::setFourierSize(){
+  // Size of the padded transform. 
   // FFTW requires fourierCols x 2*floor(fourierRows/2+1).
-  // We also allow for a pad of some % of the image size to reduce edge artifacts.
-  int i,tmp;
-	
+  // We also allow for a pad to reduce edge artifacts: what setFourierPad
+  // asked for, or else some % of the image size.
+
   // allow for a pad:
-  fourierRows = r + (int)(PAD_PROPORTION*r);
-  fourierCols = c + (int)(PAD_PROPORTION*c);
-
-  // Go up to an optimized number of rows and cols.
-  // Here are all of the optimal values (values of n where max(factor(n))<=7).
-  // Note that I've biased things a bit torward powers of 2 by removing:
-  // 	*g++=63;
-  int goodVals[167], *g=goodVals;
-  *g++=32;*g++=35;*g++=36;*g++=40;*g++=42;*g++=45;*g++=48;*g++=49;*g++=50;*g++=54;
-  *g++=56;*g++=60;*g++=64;*g++=70;*g++=72;*g++=75;*g++=80;*g++=81;*g++=84;*g++=90;
-  *g++=96;*g++=98;*g++=100;*g++=105;*g++=108;*g++=112;*g++=120;*g++=125;*g++=126;*g++=128;
-  *g++=135;*g++=140;*g++=144;*g++=147;*g++=150;*g++=160;*g++=162;*g++=168;*g++=175;*g++=180;
-  *g++=189;*g++=192;*g++=196;*g++=200;*g++=210;*g++=216;*g++=224;*g++=225;*g++=240;*g++=243;
-  *g++=245;*g++=250;*g++=252;*g++=256;*g++=270;*g++=280;*g++=288;*g++=294;*g++=300;*g++=315;
-  *g++=320;*g++=324;*g++=336;*g++=343;*g++=350;*g++=360;*g++=375;*g++=378;*g++=384;*g++=392;
-  *g++=400;*g++=405;*g++=420;*g++=432;*g++=441;*g++=448;*g++=450;*g++=480;*g++=486;*g++=490;
-  *g++=500;*g++=504;*g++=512;*g++=525;*g++=540;*g++=560;*g++=567;*g++=576;*g++=588;*g++=600;
-  *g++=625;*g++=630;*g++=640;*g++=648;*g++=672;*g++=675;*g++=686;*g++=700;*g++=720;*g++=729;
-  *g++=735;*g++=750;*g++=756;*g++=768;*g++=784;*g++=800;*g++=810;*g++=840;*g++=864;*g++=875;
-  *g++=882;*g++=896;*g++=900;*g++=945;*g++=960;*g++=972;*g++=980;*g++=1000;*g++=1008;*g++=1024;
-  *g++=1029;*g++=1050;*g++=1080;*g++=1120;*g++=1125;*g++=1134;*g++=1152;*g++=1176;*g++=1200;*g++=1215;
-  *g++=1225;*g++=1250;*g++=1260;*g++=1280;*g++=1296;*g++=1323;*g++=1344;*g++=1350;*g++=1372;*g++=1400;
-  *g++=1440;*g++=1458;*g++=1470;*g++=1500;*g++=1512;*g++=1536;*g++=1568;*g++=1575;*g++=1600;*g++=1620;
-  *g++=1680;*g++=1701;*g++=1715;*g++=1728;*g++=1750;*g++=1764;*g++=1792;*g++=1800;*g++=1875;*g++=1890;
-  *g++=1920;*g++=1944;*g++=1960;*g++=2000;*g++=2016;*g++=2025;*g++=2048;	
-  tmp = 0;
-  if (fourierRows < goodVals[0]) fourierRows = goodVals[0];
-  if (fourierCols < goodVals[0]) fourierCols = goodVals[0];
-  for (i=1;i<167;i++){
-    if (fourierRows < goodVals[i] & fourierRows > goodVals[i-1]){
-      fourierRows = goodVals[i];
-      tmp++;
-    }
-    if (fourierCols < goodVals[i] & fourierCols > goodVals[i-1]){
-      fourierCols = goodVals[i];
-      tmp++;
-    }
-    if (tmp>1) break;
-  }
-  std::cerr <<"fourier-r,c="<<fourierRows<<","<<fourierCols<<std::endl;
+  fourierRows = r + ((padRows >= 0) ? padRows : (int)(PAD_PROPORTION*r));
+  fourierCols = c + ((padCols >= 0) ? padCols : (int)(PAD_PROPORTION*c));
+
+  // Go up to a size FFTW is quick at (only small prime factors; see 
+  // fftGoodSize), and no smaller than FFT_MIN_SIZE.
+  if (fourierRows < FFT_MIN_SIZE) fourierRows = FFT_MIN_SIZE;
+  if (fourierCols < FFT_MIN_SIZE) fourierCols = FFT_MIN_SIZE;
+  fourierRows = fftGoodSize(fourierRows);
+  fourierCols = fftGoodSize(fourierCols);
+
   // rfft wants fourierCols columns and 2*floor(fourierRows/2+1) rows:
   fourierRowsTotal = 2*(int)(fourierRows/2+1);
   nFourierPix = fourierRowsTotal*fourierCols;
+}
+
+void img::setFourierPad(int rowPad, int colPad){
+  if (FFT_MEMORY_ALLOCATED) return;
+  padRows = rowPad;
+  padCols = colPad;
+  fourierRows = 0;	// worked out again when next asked for
+}
+
+int img::stageInFFT(){
+  if (planeStorage!=FLOAT32 || red==NULL) return 0;
+  if (isStagedInFFT()) return 1;
+  if (FFT_MEMORY_ALLOCATED==0 && allocateFFTspace()<0) return 0;
+  poolFree(red);
+  red = FFT_red;
+  green = FFT_green;
+  blue = FFT_blue;
+  hasPendingXform = 0;
+  return 1;
+}
 
-  FFT_red = new float [nFourierPix*3];
+int img::stageInFFT(float *buffer){
+  if (planeStorage!=FLOAT32 || red==NULL || FFT_MEMORY_ALLOCATED) return 0;
+  if (fourierRows==0) setFourierSize();
+  poolFree(red);
+  FFT_red = red = buffer;
+  FFT_green = green = FFT_red+nFourierPix;
+  FFT_blue = blue = FFT_green+nFourierPix;
+  FFT_MEMORY_ALLOCATED = 1;
+  fftBorrowed = 1;
+  hasPendingXform = 0;
+  return 1;
+}
+
+int img::allocateFFTspace(){
+  // Allocate memory for a forward real FFT. 
+  if (fourierRows==0) setFourierSize();
+  FFT_red = poolAllocFloat(nFourierPix*3);
 	
   if (FFT_red==NULL){
     FFT_MEMORY_ALLOCATED = 0;
@@ -160,177 +190,452 @@ int img::allocateFFTspace(){
 
 img::~img()
 {
-  // *** why can't we let the destructor fee memory?  If the following is
-  // uncommented, we get a segment fault near the end of the runSimulation loop!
+  freeBuffers();
+}
 
-  //	We allocated red, green and blue as one big block, so freeing
-  //	the red frees green and blue as well
-  //	delete red;
+void img::freeBuffers()
+{
+  // The planes are one block (so are the FFT planes); the buffers go back
+  // to the pool for the next image.
+  if (planeStorage!=FLOAT32) poolFree(red16);
+  else if (!isStagedInFFT()) poolFree(red);
+  if (!fftBorrowed) poolFree(FFT_red);
+  red = green = blue = NULL;
+  red16 = green16 = blue16 = NULL;
+  FFT_red = FFT_green = FFT_blue = NULL;
+  FFT_MEMORY_ALLOCATED = 0;
+  fftBorrowed = 0;
 }
 
-void img::assignUchar(unsigned char *dataPtr)
+void img::takeBuffers(img &other)
 {
+  // Everything, buffers included, comes over from other, which is left 
+  // empty (it can still be destroyed or assigned to).
   int i;
-  float *rtmp, *gtmp, *btmp;
 
-  rtmp = red;
-  gtmp = green;
-  btmp = blue;
+  red = other.red; green = other.green; blue = other.blue;
+  red16 = other.red16; green16 = other.green16; blue16 = other.blue16;
+  planeStorage = other.planeStorage;
+  FFT_red = other.FFT_red; FFT_green = other.FFT_green; FFT_blue = other.FFT_blue;
+  r = other.r; c = other.c;
+  fourierRows = other.fourierRows;
+  fourierCols = other.fourierCols;
+  fourierRowsTotal = other.fourierRowsTotal;
+  padRows = other.padRows;
+  padCols = other.padCols;
+  npix = other.npix;
+  nFourierPix = other.nFourierPix;
+  maxImgVal = other.maxImgVal;
+  FFT_MEMORY_ALLOCATED = other.FFT_MEMORY_ALLOCATED;
+  fftBorrowed = other.fftBorrowed;
+  for (i=0; i<12; i++) pendingXform[i] = other.pendingXform[i];
+  hasPendingXform = other.hasPendingXform;
+  colorSpaceLabel = other.colorSpaceLabel;
+
+  other.red = other.green = other.blue = NULL;
+  other.red16 = other.green16 = other.blue16 = NULL;
+  other.planeStorage = FLOAT32;
+  other.FFT_red = other.FFT_green = other.FFT_blue = NULL;
+  other.FFT_MEMORY_ALLOCATED = 0;
+  other.fftBorrowed = 0;
+  other.r = other.c = other.npix = other.nFourierPix = 0;
+  other.hasPendingXform = 0;
+}
 
-  // With gcc 2.95.2, I get a weird assembler error ("instruction filds is not a 386 instruction")
-  // if I don't do "*rtmp++ = (float)(1.0 * *dataPtr++);" below.
+img::img(img &&other)
+{
+  takeBuffers(other);
+}
 
-  for (i=npix-1; i>=0; i--){
-    *rtmp++ = (float)(*dataPtr++);
-    *gtmp++ = (float)(*dataPtr++);
-    *btmp++ = (float)(*dataPtr++);
-  }    
+img &img::operator=(img &&other)
+{
+  if (this != &other){
+    freeBuffers();
+    takeBuffers(other);
+  }
+  return *this;
+}
+
+void img::setPlaneStorage(planeStorageType t)
+{
+  // Reallocate the planes as 16-bit (or back to float) values.
+  // Like the constructors, this is one block divided up three ways.
+  if (t==planeStorage) return;
+  if (planeStorage!=FLOAT32) poolFree(red16);
+  else if (!isStagedInFFT()) poolFree(red);
+  red = green = blue = NULL;
+  red16 = green16 = blue16 = NULL;
+  hasPendingXform = 0;
+  planeStorage = t;
+
+  if (t==FLOAT32){
+    red = poolAllocFloat(npix*3);
+    green = red+npix;
+    blue = green+npix;
+  }else{
+    red16 = (unsigned short *)poolAlloc(npix*3*sizeof(unsigned short));
+    green16 = red16+npix;
+    blue16 = green16+npix;
+  }
+}
+
+// 16-bit plane values. FLOAT16 is IEEE half precision (11 significant
+// bits, so about 0.1 at 255); BFLOAT16 is the top half of a float (8
+// significant bits, but the full float range). Both round to nearest even.
+// With F16C the half conversions are 8 at a time; the bfloat16 ones are
+// plain integer ops, which the compiler vectorizes.
+static inline unsigned short floatToHalf(float f)
+{
+  union { float f; unsigned int u; } v;
+  v.f = f;
+  unsigned int sign = (v.u >> 16) & 0x8000;
+  unsigned int a = v.u & 0x7fffffff;
+  if (a >= 0x47800000)			// too big (or inf/NaN)
+    return sign | (a > 0x7f800000 ? 0x7e00 : 0x7c00);
+  if (a < 0x38800000){			// denormal (or zero)
+    if (a < 0x33000000) return sign;
+    unsigned int m = (a & 0x7fffff) | 0x800000;
+    int shift = 126 - (a >> 23);
+    unsigned int h = m >> shift;
+    unsigned int rest = m & ((1u << shift) - 1), halfway = 1u << (shift-1);
+    if (rest > halfway || (rest == halfway && (h & 1))) h++;
+    return sign | h;
+  }
+  a += 0xc8000fff + ((a >> 13) & 1);	// rebias the exponent, round
+  return sign | (a >> 13);
+}
+
+static inline float halfToFloat(unsigned short h)
+{
+  union { float f; unsigned int u; } v;
+  unsigned int sign = (unsigned int)(h & 0x8000) << 16;
+  unsigned int e = (h >> 10) & 0x1f, m = h & 0x3ff;
+  if (e == 0){
+    v.f = m * (1.0f/16777216.0f);	// denormal: m * 2^-24
+    v.u |= sign;
+    return v.f;
+  }
+  v.u = sign | (e == 31 ? 0x7f800000 | (m << 13) : ((e + 112) << 23) | (m << 13));
+  return v.f;
+}
+
+void packPlane(const float *src, unsigned short *dst, int n, planeStorageType t)
+{
+  int i = 0;
+  if (t==BFLOAT16){
+    for (; i<n; i++){
+      unsigned int u;
+      memcpy(&u, src+i, 4);
+      dst[i] = (u + 0x7fff + ((u >> 16) & 1)) >> 16;
+    }
+    return;
+  }
+#ifdef __F16C__
+  for (; i+8<=n; i+=8)
+    _mm_storeu_si128((__m128i *)(dst+i),
+		     _mm256_cvtps_ph(_mm256_loadu_ps(src+i), _MM_FROUND_TO_NEAREST_INT));
+#endif
+  for (; i<n; i++) dst[i] = floatToHalf(src[i]);
+}
+
+void unpackPlane(const unsigned short *src, float *dst, int n, planeStorageType t)
+{
+  int i = 0;
+  if (t==BFLOAT16){
+    for (; i<n; i++){
+      unsigned int u = (unsigned int)src[i] << 16;
+      memcpy(dst+i, &u, 4);
+    }
+    return;
+  }
+#ifdef __F16C__
+  for (; i+8<=n; i+=8)
+    _mm256_storeu_ps(dst+i, _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)(src+i))));
+#endif
+  for (; i<n; i++) dst[i] = halfToFloat(src[i]);
+}
+
+// Packed RGBRGB... bytes <-> three float planes, with an optional multiplier.
+//
+// The SSE2 paths handle 16 pixels (48 bytes) per iteration: the bytes are 
+// widened and converted in memory order, then each run of 4 pixels (12 
+// floats in 3 registers) is transposed into r,g,b with shuffles. Going back,
+// values are clamped to 0-255 before rounding and packs/packus saturate the 
+// conversion to bytes, so nothing that escaped clipping can wrap around.
+// The scalar loops finish the tail (and are what non-x86 builds use).
+static void deinterleaveRGB(const unsigned char *src, float *rtmp, float *gtmp, float *btmp, 
+			    int n, float mult)
+{
+  int i = 0;
+#ifdef __SSE2__
+  const __m128i zero = _mm_setzero_si128();
+  const __m128 m = _mm_set1_ps(mult);
+  __m128 f[12];
+  for (; i+16<=n; i+=16){
+    for (int k=0; k<3; k++){
+      __m128i v = _mm_loadu_si128((const __m128i *)(src+3*i+16*k));
+      __m128i lo = _mm_unpacklo_epi8(v, zero);
+      __m128i hi = _mm_unpackhi_epi8(v, zero);
+      f[4*k  ] = _mm_cvtepi32_ps(_mm_unpacklo_epi16(lo, zero));
+      f[4*k+1] = _mm_cvtepi32_ps(_mm_unpackhi_epi16(lo, zero));
+      f[4*k+2] = _mm_cvtepi32_ps(_mm_unpacklo_epi16(hi, zero));
+      f[4*k+3] = _mm_cvtepi32_ps(_mm_unpackhi_epi16(hi, zero));
+    }
+    for (int k=0; k<4; k++){
+      // f0 = r0 g0 b0 r1, f1 = g1 b1 r2 g2, f2 = b2 r3 g3 b3
+      __m128 f0 = f[3*k], f1 = f[3*k+1], f2 = f[3*k+2];
+      __m128 t0 = _mm_shuffle_ps(f1, f2, _MM_SHUFFLE(2,1,3,2)); // r2 g2 r3 g3
+      __m128 t1 = _mm_shuffle_ps(f0, f1, _MM_SHUFFLE(1,0,2,1)); // g0 b0 g1 b1
+      _mm_storeu_ps(rtmp+i+4*k, _mm_mul_ps(_mm_shuffle_ps(f0, t0, _MM_SHUFFLE(2,0,3,0)), m));
+      _mm_storeu_ps(gtmp+i+4*k, _mm_mul_ps(_mm_shuffle_ps(t1, t0, _MM_SHUFFLE(3,1,2,0)), m));
+      _mm_storeu_ps(btmp+i+4*k, _mm_mul_ps(_mm_shuffle_ps(t1, f2, _MM_SHUFFLE(3,0,3,1)), m));
+    }
+  }
+#endif
+  for (; i<n; i++){
+    rtmp[i] = src[3*i  ] * mult;
+    gtmp[i] = src[3*i+1] * mult;
+    btmp[i] = src[3*i+2] * mult;
+  }
+}
+
+static inline unsigned char saturateUchar(float v)
+{
+  v = v > 0.0f ? v : 0.0f;
+  v = v < 255.0f ? v : 255.0f;
+  return (unsigned char)(v + .5f);
+}
+
+static void interleaveRGB(unsigned char *dst, const float *rtmp, const float *gtmp, const float *btmp, 
+			  int n, float mult)
+{
+  int i = 0;
+#ifdef __SSE2__
+  const __m128 m = _mm_set1_ps(mult);
+  const __m128 zero = _mm_setzero_ps();
+  const __m128 top = _mm_set1_ps(255.0f);
+  const __m128 half = _mm_set1_ps(0.5f);
+  __m128i q[12];
+  for (; i+16<=n; i+=16){
+    for (int k=0; k<4; k++){
+      __m128 x = _mm_mul_ps(_mm_loadu_ps(rtmp+i+4*k), m);
+      __m128 y = _mm_mul_ps(_mm_loadu_ps(gtmp+i+4*k), m);
+      __m128 z = _mm_mul_ps(_mm_loadu_ps(btmp+i+4*k), m);
+      x = _mm_add_ps(_mm_min_ps(_mm_max_ps(x, zero), top), half);
+      y = _mm_add_ps(_mm_min_ps(_mm_max_ps(y, zero), top), half);
+      z = _mm_add_ps(_mm_min_ps(_mm_max_ps(z, zero), top), half);
+      __m128 xy01 = _mm_unpacklo_ps(x, y);                             // r0 g0 r1 g1
+      __m128 xy23 = _mm_unpackhi_ps(x, y);                             // r2 g2 r3 g3
+      __m128 t = _mm_shuffle_ps(z, xy01, _MM_SHUFFLE(2,2,0,0));        // b0 b0 r1 r1
+      __m128 u = _mm_shuffle_ps(xy01, z, _MM_SHUFFLE(1,1,3,3));        // g1 g1 b1 b1
+      __m128 w = _mm_shuffle_ps(xy23, z, _MM_SHUFFLE(3,2,3,2));        // r3 g3 b2 b3
+      q[3*k  ] = _mm_cvttps_epi32(_mm_shuffle_ps(xy01, t, _MM_SHUFFLE(2,0,1,0))); // r0 g0 b0 r1
+      q[3*k+1] = _mm_cvttps_epi32(_mm_shuffle_ps(u, xy23, _MM_SHUFFLE(1,0,2,0))); // g1 b1 r2 g2
+      q[3*k+2] = _mm_cvttps_epi32(_mm_shuffle_ps(w, w, _MM_SHUFFLE(3,1,0,2)));    // b2 r3 g3 b3
+    }
+    for (int k=0; k<3; k++){
+      __m128i lo = _mm_packs_epi32(q[4*k  ], q[4*k+1]);
+      __m128i hi = _mm_packs_epi32(q[4*k+2], q[4*k+3]);
+      _mm_storeu_si128((__m128i *)(dst+3*i+16*k), _mm_packus_epi16(lo, hi));
+    }
+  }
+#endif
+  for (; i<n; i++){
+    dst[3*i  ] = saturateUchar(rtmp[i] * mult);
+    dst[3*i+1] = saturateUchar(gtmp[i] * mult);
+    dst[3*i+2] = saturateUchar(btmp[i] * mult);
+  }
+}
+
+void img::assignUchar(unsigned char *dataPtr)
+{
+  // new pixels, so anything queued for the old ones is moot
+  hasPendingXform = 0;
+  deinterleaveRGB(dataPtr, red, green, blue, npix, 1.0f);
   return;
 }
 
 void img::extractUchar(unsigned char *dataPtr)
 {
-  int i;
-  float *rtmp, *gtmp, *btmp;
-	
-  rtmp = red;
-  gtmp = green;
-  btmp = blue;
-	
-  for (i=npix-1; i>=0; i--){
-    *dataPtr++ = (unsigned char)((*rtmp++) + .5);
-    *dataPtr++ = (unsigned char)((*gtmp++) + .5);
-    *dataPtr++ = (unsigned char)((*btmp++) + .5);
-  }
+  // values outside 0-255 saturate rather than wrap around
+  flushTransforms();
+  interleaveRGB(dataPtr, red, green, blue, npix, 1.0f);
   return;
 }
 
 void img::assignUchar(unsigned char *dataPtr, const float scale)
 {
-  int i;
-  float *rtmp, *gtmp, *btmp;
-	
-  rtmp = red;
-  gtmp = green;
-  btmp = blue;
-
-  for (i=npix-1; i>=0; i--){
-    *rtmp++ = (float)((*dataPtr++) / scale);
-    *gtmp++ = (float)((*dataPtr++) / scale);
-    *btmp++ = (float)((*dataPtr++) / scale);
-  }    
+  hasPendingXform = 0;
+  // divide by scale (one reciprocal, then a multiply per element)
+  deinterleaveRGB(dataPtr, red, green, blue, npix, 1.0f/scale);
   return;
 }
 
 void img::extractUchar(unsigned char *dataPtr, const float scale)
+{
+  flushTransforms();
+  interleaveRGB(dataPtr, red, green, blue, npix, scale);
+  return;
+}
+
+// Color-space changes are not applied right away. Each call is composed into
+// one pending affine transform (pendingXform, row-major 3x3 plus an offset
+// column), which is only applied when something needs the pixel values. 
+// The nonlinear stages (gamma look-up, Brettel, clipping) apply it block by 
+// block inside their own pass, so a chain like rgb2lms -> lms2opp, or 
+// opp2rgb -> clip, costs one trip through memory instead of two or three.
+// Anything that composes to the identity is dropped altogether.
+void img::resetTransform()
 {
   int i;
-  float *rtmp, *gtmp, *btmp;
-	
-  rtmp = red;
-  gtmp = green;
-  btmp = blue;
-	
-  for (i=npix-1; i>=0; i--){
-    *dataPtr++ = (unsigned char)((*rtmp++) * scale + .5);
-    *dataPtr++ = (unsigned char)((*gtmp++) * scale + .5);
-    *dataPtr++ = (unsigned char)((*btmp++) * scale + .5);
+  for (i=0; i<12; i++) pendingXform[i] = 0.0;
+  pendingXform[0] = pendingXform[5] = pendingXform[10] = 1.0;
+  hasPendingXform = 0;
+}
+
+void img::queueTransform(const float A[9], const float t[3])
+{
+  // pending = [A t] * pending
+  float old[12];
+  int i, j;
+
+  if (!hasPendingXform) resetTransform();
+  for (i=0; i<12; i++) old[i] = pendingXform[i];
+  for (i=0; i<3; i++){
+    for (j=0; j<4; j++)
+      pendingXform[i*4+j] = A[i*3]*old[j] + A[i*3+1]*old[4+j] + A[i*3+2]*old[8+j];
+    pendingXform[i*4+3] += t[i];
+  }
+
+  // Is what's left the identity? (eg. rgb2lms followed by lms2rgb of the same display)
+  hasPendingXform = 0;
+  for (i=0; i<3; i++){
+    for (j=0; j<3; j++)
+      if (fabs(pendingXform[i*4+j] - (i==j ? 1.0 : 0.0)) > 1e-5) hasPendingXform = 1;
+    if (fabs(pendingXform[i*4+3]) > 1e-5*maxImgVal) hasPendingXform = 1;
   }
-  return;
 }
 
-void img::changeColorSpace(float tm[]){
-  // post-multiply by tm' to convert the pixels to the output color space
-  float redOld, greenOld;
+void img::applyTransformBlock(int start, int n)
+{
+  // apply the pending transform to pixels start..start+n-1
+  const float *tm = pendingXform;
+  float * __restrict rtmp = red+start;
+  float * __restrict gtmp = green+start;
+  float * __restrict btmp = blue+start;
   int i;
-  float *rtmp, *gtmp, *btmp;
-	
-  rtmp = red;
-  gtmp = green;
-  btmp = blue;
 
-  for (i=npix-1; i>=0; i--){
-    redOld = *rtmp;
-    greenOld = *gtmp;
-    *rtmp = redOld*tm[0] + greenOld*tm[1] + (*btmp)*tm[2];
-    *gtmp = redOld*tm[3] + greenOld*tm[4] + (*btmp)*tm[5];
-    *btmp = redOld*tm[6] + greenOld*tm[7] + (*btmp)*tm[8];
-    btmp++; gtmp++; rtmp++;
+  for (i=0; i<n; i++){
+    float rOld = rtmp[i], gOld = gtmp[i], bOld = btmp[i];
+    rtmp[i] = rOld*tm[0] + gOld*tm[1] + bOld*tm[ 2] + tm[ 3];
+    gtmp[i] = rOld*tm[4] + gOld*tm[5] + bOld*tm[ 6] + tm[ 7];
+    btmp[i] = rOld*tm[8] + gOld*tm[9] + bOld*tm[10] + tm[11];
   }
+}
+
+void img::flushTransforms()
+{
+  if (hasPendingXform) applyTransformBlock(0, npix);
+  hasPendingXform = 0;
+}
+
+void img::changeColorSpace(float tm[]){
+  // post-multiply by tm' to convert the pixels to the output color space
+  const float zero[3] = {0.0, 0.0, 0.0};
+  queueTransform(tm, zero);
   return;
 }
 
-void img::applyLookupTable(float *tableR, float *tableG, float *tableB){
-  // this function assumes that the image data are 0-imgValMax and that the look-up
-  // table length is equal to imgValMax.
-  float *rtmp, *gtmp, *btmp;
-  int i;
+// Look up every value of one plane in a gamma table. The index is rounded to
+// the nearest entry and clamped to [0,tableLen-1], so values pushed out of 
+// range by a color-space transform can never read past the end of the table.
+// Clamping before the float->int conversion keeps the loop branch-free; with 
+// AVX2 the loads become 8-wide gathers.
+static void lookupPlane(float *plane, const float *table, int n, int tableLen)
+{
+  const float maxIdx = (float)(tableLen-1);
+  int i = 0;
+
+#ifdef __AVX2__
+  const __m256 zero = _mm256_setzero_ps();
+  const __m256 half = _mm256_set1_ps(0.5f);
+  const __m256 top = _mm256_set1_ps(maxIdx);
+  for (; i+8<=n; i+=8){
+    __m256 v = _mm256_add_ps(_mm256_loadu_ps(plane+i), half);
+    v = _mm256_min_ps(_mm256_max_ps(v, zero), top);
+    _mm256_storeu_ps(plane+i, _mm256_i32gather_ps(table, _mm256_cvttps_epi32(v), 4));
+  }
+#elif defined(__SSE2__)
+  const __m128 zero = _mm_setzero_ps();
+  const __m128 half = _mm_set1_ps(0.5f);
+  const __m128 top = _mm_set1_ps(maxIdx);
+  int idx[4] __attribute__((aligned(16)));
+  for (; i+4<=n; i+=4){
+    __m128 v = _mm_add_ps(_mm_loadu_ps(plane+i), half);
+    v = _mm_min_ps(_mm_max_ps(v, zero), top);
+    _mm_store_si128((__m128i *)idx, _mm_cvttps_epi32(v));
+    plane[i  ] = table[idx[0]];
+    plane[i+1] = table[idx[1]];
+    plane[i+2] = table[idx[2]];
+    plane[i+3] = table[idx[3]];
+  }
+#endif
 
-  rtmp = red;
-  gtmp = green;
-  btmp = blue;
+  for (; i<n; i++){
+    float v = plane[i] + 0.5f;
+    v = v > 0.0f ? v : 0.0f;
+    v = v < maxIdx ? v : maxIdx;
+    plane[i] = table[(int)v];
+  }
+}
 
-  for(i=npix-1; i>=0; i--){
-    *rtmp = tableR[(int)(*rtmp + 0.5)];
-    *gtmp = tableG[(int)(*gtmp + 0.5)];
-    *btmp = tableB[(int)(*btmp + 0.5)];
-    btmp++; gtmp++; rtmp++;
-  }
-
-  // Unrolling these loops seems to speed em up a bit, 
-  // but the follow code doesn't quite work ;)
-  //   int m = npix>>2;
-  //   int n = npix&3;
-  //   switch (m){
-  //     while(n--){
-  //       *rtmp = tableR[(int)(*rtmp++ +0.5)];
-  //     case 3:	*rtmp = tableR[(int)(*rtmp++ +0.5)];
-  //     case 2:	*rtmp = tableR[(int)(*rtmp++ +0.5)];
-  //     case 1:	*rtmp = tableR[(int)(*rtmp++ +0.5)];
-  //     }
-  //   }
-  //   n = npix&3;
-  //   switch (m){
-  //     while(n--){
-  //       *gtmp = tableG[(int)(*gtmp++ +0.5)];
-  //     case 3:	*gtmp = tableG[(int)(*gtmp++ +0.5)];
-  //     case 2:	*gtmp = tableG[(int)(*gtmp++ +0.5)];
-  //     case 1:	*gtmp = tableG[(int)(*gtmp++ +0.5)];
-  //     }
-  //   }
-  //   n = npix&3;
-  //   switch (m){
-  //     while(n--){
-  //       *btmp = tableB[(int)(*btmp++ +0.5)];
-  //     case 3:	*btmp = tableB[(int)(*btmp++ +0.5)];
-  //     case 2:	*btmp = tableB[(int)(*btmp++ +0.5)];
-  //     case 1:	*btmp = tableB[(int)(*btmp++ +0.5)];
-  //     }
-  //   }
+void img::applyLookupTable(float *tableR, float *tableG, float *tableB){
+  // this function assumes that the look-up table length is maxImgVal+1.
+  applyLookupTable(tableR, tableG, tableB, (int)(maxImgVal+1.5));
+}
+
+void img::applyLookupTable(float *tableR, float *tableG, float *tableB, int tableLen){
+  // Values are rounded to the nearest table entry; anything outside 
+  // 0-(tableLen-1) is clamped to the ends of the table.
+  // (The old per-pixel loop did no bounds checking, and unrolling it by 
+  // hand never quite worked- see lookupPlane above for the replacement.)
+  int b, n;
+
+  if (!hasPendingXform){
+    lookupPlane(red, tableR, npix, tableLen);
+    lookupPlane(green, tableG, npix, tableLen);
+    lookupPlane(blue, tableB, npix, tableLen);
+    return;
+  }
+  for (b=0; b<npix; b+=TRANSFORM_BLOCK){
+    n = npix-b < TRANSFORM_BLOCK ? npix-b : TRANSFORM_BLOCK;
+    applyTransformBlock(b, n);
+    lookupPlane(red+b, tableR, n, tableLen);
+    lookupPlane(green+b, tableG, n, tableLen);
+    lookupPlane(blue+b, tableB, n, tableLen);
+  }
+  hasPendingXform = 0;
   return;
 }
 
 void img::clipValRange()
 {
   // this function ensures that the image data are 0-imgValMax.
-  float *rtmp, *gtmp, *btmp;
-  int i;
-	
-  rtmp = red;
-  gtmp = green;
-  btmp = blue;
-	
-  for (i=npix-1; i>=0; i--){
-    if (*rtmp>maxImgVal) *rtmp = maxImgVal;
-    if (*gtmp>maxImgVal) *gtmp = maxImgVal;
-    if (*btmp>maxImgVal) *btmp = maxImgVal;
-    if (*btmp<0.0) *btmp = 0.0;
-    if (*gtmp<0.0) *gtmp = 0.0;
-    if (*rtmp<0.0) *rtmp = 0.0;
-    rtmp++;
-    gtmp++;
-    btmp++;
-  } 
+  int b, n, i;
+
+  for (b=0; b<npix; b+=TRANSFORM_BLOCK){
+    n = npix-b < TRANSFORM_BLOCK ? npix-b : TRANSFORM_BLOCK;
+    if (hasPendingXform) applyTransformBlock(b, n);
+    float * __restrict rtmp = red+b;
+    float * __restrict gtmp = green+b;
+    float * __restrict btmp = blue+b;
+    for (i=0; i<n; i++){
+      rtmp[i] = rtmp[i] < maxImgVal ? (rtmp[i] > 0.0f ? rtmp[i] : 0.0f) : maxImgVal;
+      gtmp[i] = gtmp[i] < maxImgVal ? (gtmp[i] > 0.0f ? gtmp[i] : 0.0f) : maxImgVal;
+      btmp[i] = btmp[i] < maxImgVal ? (btmp[i] > 0.0f ? btmp[i] : 0.0f) : maxImgVal;
+    }
+  }
+  hasPendingXform = 0;
   return;
 }
 
@@ -341,7 +646,8 @@ void img::scaleValRange()
   // offending RGB triplet down to the correct range.
   float *rtmp, *gtmp, *btmp, scale;
   int i;
-	
+
+  flushTransforms();
   rtmp = red;
   gtmp = green;
   btmp = blue;
@@ -382,25 +688,15 @@ void img::changeColorSpace4Matrix(float tm[]){
   // This is similar to changeColorSpace except that we can use a 4x4 matrix
   // to include translations as well as all the tranforms possible with a 3x3,
   // plus it is a pre-multipy convention.
-  
-  float redOld, greenOld;
-  int i;
-  float *rtmp, *gtmp, *btmp;
-	
-  rtmp = red;
-  gtmp = green;
-  btmp = blue;
-  
+  // Like changeColorSpace, this only queues the transform.
+  float A[9], t[3];
+  int i, j;
 
-  for (i=npix-1; i>=0; i--){
-    redOld = *rtmp;
-    greenOld = *gtmp;
-    *rtmp = redOld*tm[0] + greenOld*tm[4] + (*btmp)*tm[ 8] + tm[12];
-    *gtmp = redOld*tm[1] + greenOld*tm[5] + (*btmp)*tm[ 9] + tm[13];
-    *btmp = redOld*tm[2] + greenOld*tm[6] + (*btmp)*tm[10] + tm[14];
-    
-    btmp++; gtmp++; rtmp++;
+  for (i=0; i<3; i++){
+    for (j=0; j<3; j++) A[i*3+j] = tm[j*4+i];
+    t[i] = tm[12+i];
   }
+  queueTransform(A, t);
   return;
 }
 
@@ -438,6 +734,9 @@ void img::computeDaltonize(float *outMat, float lmStretch, float lumScale, float
   // I don't think we need to do SVD decomposition - just compute the variance 
   // in the different image planes.
    
+   // The statistics need the actual pixel values
+   flushTransforms();
+
    // Zero the accumulators first..
     for (int t=0;t<3;t++) {
       varVector[t]=0;
@@ -520,11 +819,48 @@ void img::computeDaltonize(float *outMat, float lmStretch, float lumScale, float
     //changeColorSpace4Matrix(outMat);
 }
 
-void img::brettelTransform(char viewerType, float rgb2lms[]) {
-  // Assumes that the image is in LMS space
-  float anchor_e[3], anchor[12];
-  float a1,b1,c1,a2,b2,c2,inflectionVal,tmp;
+// Brettel projection of one cone plane. The missing cone (out) is rebuilt
+// from the two remaining ones (x and y) on one of the two half-planes:
+//   out = k1x*x + k1y*y   if y/x < inflectionVal
+//   out = k2x*x + k2y*y   otherwise
+// The ratio test is done as a sign test, (y - inflectionVal*x)*x < 0, which 
+// is the same comparison without the division. So black pixels (x==0) no 
+// longer produce inf/NaN, and the select compiles to SIMD blends.
+static void brettelPlane(const float * __restrict x, const float * __restrict y, 
+			 float * __restrict out, int n, float inflectionVal,
+			 float k1x, float k1y, float k2x, float k2y)
+{
   int i;
+  for (i=0; i<n; i++){
+    float xv = x[i], yv = y[i];
+    float side = (yv - inflectionVal*xv) * xv;
+    float p1 = k1x*xv + k1y*yv;
+    float p2 = k2x*xv + k2y*yv;
+    out[i] = side < 0.0f ? p1 : p2;
+  }
+}
+
+void img::brettelPass(float *x, float *y, float *out, float inflectionVal,
+		      float k1x, float k1y, float k2x, float k2y)
+{
+  // run brettelPlane over the image, applying any queued transform as we go
+  int b, n;
+
+  for (b=0; b<npix; b+=TRANSFORM_BLOCK){
+    n = npix-b < TRANSFORM_BLOCK ? npix-b : TRANSFORM_BLOCK;
+    if (hasPendingXform) applyTransformBlock(b, n);
+    brettelPlane(x+b, y+b, out+b, n, inflectionVal, k1x, k1y, k2x, k2y);
+  }
+  hasPendingXform = 0;
+}
+
+int img::brettelParams(char viewerType, const float rgb2lms[], float params[5]) {
+  // Works out the Brettel projection for one observer: 
+  //   params = {inflectionVal, k1x, k1y, k2x, k2y} 
+  // as used by brettelPlane. Returns 0 (and leaves params alone) for 
+  // anything but 'p', 'd' or 't'.
+  float anchor_e[3], anchor[12];
+  float a1,b1,c1,a2,b2,c2;
     
   // Performs protan, deutan or tritan color image simulation based on 
   // Brettel, Vienot and Mollon JOSA 14/10 1997
@@ -548,18 +884,8 @@ void img::brettelTransform(char viewerType, float rgb2lms[]) {
   anchor_e[1] = rgb2lms[3]+rgb2lms[4]+rgb2lms[5];
   anchor_e[2] = rgb2lms[6]+rgb2lms[7]+rgb2lms[8];
 	    
-    
-  // The image is in LMS space
-  // Now follow the rules....
-    
   switch (viewerType) {
-  case 'n':
-    //		disp(TM("Normal observer - nothing to do"));
-    return;
-      
   case 'd':
-    //		disp(TM("Doing deuteranope conversion"));
-    // find a,b,c...
     // find a,b,c for lam=575nm and lam=475
     a1 = anchor_e[1]*anchor[8]-anchor_e[2]*anchor[7];
     b1 = anchor_e[2]*anchor[6]-anchor_e[0]*anchor[8];
@@ -567,23 +893,12 @@ void img::brettelTransform(char viewerType, float rgb2lms[]) {
     a2 = anchor_e[1]*anchor[2]-anchor_e[2]*anchor[1];
     b2 = anchor_e[2]*anchor[0]-anchor_e[0]*anchor[2];
     c2 = anchor_e[0]*anchor[1]-anchor_e[1]*anchor[0];
-    inflectionVal = (anchor_e[2]/anchor_e[0]);
-    // split image up into two sets.
-    // Set 1: regions where lambda_a=575, set 2: lambda_a=475
-    // construct the two parts of the M-component 
-    // from pixels which fall on differnt sides of the two 'wings'
-    // *** unroll this loop
-    for (i=npix-1; i>=0; i--){
-      tmp = (blue[i]) / (red[i]);
-      if(tmp<inflectionVal)
-	green[i] = -(a1 * red[i] + c1 * blue[i]) / b1;
-      else
-	green[i] = -(a2 * red[i] + c2 * blue[i]) / b2;
-    }
-    break;
+    params[0] = (anchor_e[2]/anchor_e[0]);
+    params[1] = -a1/b1; params[2] = -c1/b1;
+    params[3] = -a2/b2; params[4] = -c2/b2;
+    return 1;
       
   case 'p':
-    //		disp(TM("Doing protanope conversion"));       
     // find a,b,c for lam=575nm and lam=475
     a1 = anchor_e[1]*anchor[8]-anchor_e[2]*anchor[7];
     b1 = anchor_e[2]*anchor[6]-anchor_e[0]*anchor[8];
@@ -591,183 +906,156 @@ void img::brettelTransform(char viewerType, float rgb2lms[]) {
     a2 = anchor_e[1]*anchor[2]-anchor_e[2]*anchor[1];
     b2 = anchor_e[2]*anchor[0]-anchor_e[0]*anchor[2];
     c2 = anchor_e[0]*anchor[1]-anchor_e[1]*anchor[0];
-    inflectionVal = (anchor_e[2]/anchor_e[1]);
-    // split image up into two sets.
-    // Set 1: regions where lambda_a=575, set 2: lambda_a=475
-    // construct the two parts of the M-component 
-    // from pixels which fall on differnt sides of the two 'wings'
-    for (i=npix-1; i>=0; i--){
-      tmp = blue[i]/green[i];
-      if(tmp<inflectionVal)
-	red[i] = -(b1*green[i]+c1*blue[i])/a1;
-      else
-	red[i] = -(b2*green[i]+c2*blue[i])/a2;
-    }
-    break;
+    params[0] = (anchor_e[2]/anchor_e[1]);
+    params[1] = -b1/a1; params[2] = -c1/a1;
+    params[3] = -b2/a2; params[4] = -c2/a2;
+    return 1;
       
   case 't':
-    //		disp(TM("Doing tritanope conversion"));
-    // split image up into two sets.
-    // Set 1: regions where lambda_a=575, set 2: lambda_a=475
+    // find a,b,c for lam=660nm and lam=485
     a1 = anchor_e[1]*anchor[11]-anchor_e[2]*anchor[10];
     b1 = anchor_e[2]*anchor[9]-anchor_e[0]*anchor[11];
     c1 = anchor_e[0]*anchor[10]-anchor_e[1]*anchor[9];
     a2 = anchor_e[1]*anchor[5]-anchor_e[2]*anchor[4];
     b2 = anchor_e[2]*anchor[3]-anchor_e[0]*anchor[5];
     c2 = anchor_e[0]*anchor[4]-anchor_e[1]*anchor[3];
-    inflectionVal = (anchor_e[1]/anchor_e[0]);
-    for (i=npix-1; i>=0; i--){
-      tmp = green[i]/red[i];
-      if(tmp<inflectionVal)
-	blue[i] = -(a1*red[i]+b1*green[i])/c1;
-      else
-	blue[i] = -(a2*red[i]+b2*green[i])/c2;
-    }
-    break;
+    params[0] = (anchor_e[1]/anchor_e[0]);
+    params[1] = -a1/c1; params[2] = -b1/c1;
+    params[3] = -a2/c2; params[4] = -b2/c2;
+    return 1;
+  }
+  return 0;
+}
+
+void img::brettelTransform(char viewerType, float rgb2lms[]) {
+  // Assumes that the image is in LMS space
+  float p[5];
 
-  default:
-    //        disp(TM("This condition is not catered for yet..."));
+  if (viewerType=='n') return;	// Normal observer - nothing to do
+  if (!brettelParams(viewerType, rgb2lms, p)){
     std::cerr << "This condition is not catered for yet..." << viewerType << std::endl;
-  } // end switch
-    
+    return;
+  }
+
+  // split image up into two sets.
+  // Set 1: regions where lambda_a=575, set 2: lambda_a=475
+  // construct the missing cone plane from pixels which fall on 
+  // different sides of the two 'wings'
+  switch (viewerType) {
+  case 'd': brettelPass(red, blue, green, p[0], p[1], p[2], p[3], p[4]); break;
+  case 'p': brettelPass(green, blue, red, p[0], p[1], p[2], p[3], p[4]); break;
+  case 't': brettelPass(red, green, blue, p[0], p[1], p[2], p[3], p[4]); break;
+  }
 }
 
 
-int img::doFFT(int direction)
+// Where sample p (n <= p < period) of a line of n, padded out to period,
+// is taken from: the first half of the pad mirrors the line's end, the 
+// second half its start
+static int padSource(int p, int n, int period)
+{
+  int h = (period-n+1)/2;
+  return mirrorIndex((p < n+h) ? p : p-period, n);
+}
+
+void img::padForFFT(int channels)
+{
+  int i,j,ch;
+  int staged = isStagedInFFT();
+  float *planes[3] = {red, green, blue};
+  unsigned short *planes16[3] = {red16, green16, blue16};
+  float *imPtr, *fftPtr;
+
+  if (FFT_MEMORY_ALLOCATED==0 && allocateFFTspace()<0) return;
+  flushTransforms();
+
+  // Put the image into the fourier memory space, with the pad filled 
+  // as setFourierPad says: the first half of each line's pad is its end 
+  // mirrored, the second half its start, and the rows below are the 
+  // image's bottom and top rows mirrored the same way. So where the 
+  // convolution wraps round, each edge sees its own reflection rather 
+  // than the far side of the image.
+  int rowPad = fourierRows-r, colPad = fourierCols-c;
+  int *padSrc = new int[rowPad+colPad];
+  for (j=0;j<rowPad;j++) padSrc[j] = padSource(r+j, r, fourierRows);
+  for (i=0;i<colPad;i++) padSrc[rowPad+i] = padSource(c+i, c, fourierCols);
+  for (ch=0;ch<3;ch++){
+    if (!(channels & (1<<ch))) continue;
+    imPtr = planes[ch];
+    fftPtr = FFT_red + (long)ch*nFourierPix;
+    for (i=0;i<c;i++){
+      float *row = fftPtr + (long)i*fourierRowsTotal;
+      if (planeStorage!=FLOAT32){
+	// 16-bit planes: widen this row straight into the FFT buffer
+	unpackPlane(planes16[ch]+(long)i*r, row, r, planeStorage);
+      }
+      else if (!staged) memcpy(row, imPtr+(long)i*r, r*sizeof(float));
+      for (j=0;j<rowPad;j++) row[r+j] = row[padSrc[j]];
+    }
+    for (i=0;i<colPad;i++)
+      memcpy(fftPtr+(long)(c+i)*fourierRowsTotal, fftPtr+(long)padSrc[rowPad+i]*fourierRowsTotal,
+	     fourierRows*sizeof(float));
+  }
+  delete [] padSrc;
+}
+
+int img::doFFT(int direction, int channels)
 {
   // Function to do FFT on image data using FFTW routines. 
   // Uses the FFTW routines which allow you to hold real-space transforms in 1/2 Fourier space (since they're Hermitian)
   // This is handy as it allows us to do in-place operations on image data
 
-  // NB - currently, we force the routine to generate a new plan each time.
-  // the wisdom write to file routine causes a crash for some reason.
-  // However, FFTs seem to be very fast even just using the 'ESTIMATE' option.
-
-  // NOTE: Image pixels typically stacked row-by-row, but 
-  // rfftw2d wants col-by-col, so we pretend that cols are rows and rows
-  // are col:  nFourierPix should have an extra row, so we give it an extra col.
-  // rfftw2d wants the first two parameters to be 'rows,cols', but we give it
-  // 'cols,rows'.  It all seems to work out fine in the end...
-
-  fftwf_plan plan;
-  int i,j,index,reflect;
-  float *imPtrR, *imPtrG, *imPtrB, *fftPtrR, *fftPtrG, *fftPtrB, scale;
+  // The plans come from the plan cache (fftplan.h), so each size is only 
+  // planned once, at whatever rigor was asked for (FFTW_ESTIMATE by default),
+  // and fftRun spreads the channels over the FFT threads (-j).
+  // channels is a mask (1 = red, 2 = green, 4 = blue); the rest of the 
+  // planes are left alone.
+
+  // The planes are row-major, c rows of r (r is the width), so the 2-D 
+  // r2c transform is fourierCols x fourierRows, the rows halved; each row 
+  // is fourierRowsTotal floats in the FFT buffer. Planes staged in that 
+  // buffer (stageInFFT) are transformed where they are; otherwise they 
+  // are copied in and out a row at a time.
+  // Neither transform is normalized: the 1/(fourierRows*fourierCols) is 
+  // in the kernel spectra (kernelSep::setKernFFT).
+
+  int i,ch;
+  int staged = isStagedInFFT();
+  float *planes[3] = {red, green, blue};
+  unsigned short *planes16[3] = {red16, green16, blue16};
+  float *imPtr, *fftPtr;
 	
   // See if FFT memory has been allocated
   if (FFT_MEMORY_ALLOCATED==0) {
     if (allocateFFTspace()<0) return (-1);
   } // end if fft is allocated
 
-  int n[2];
-  n[0] = fourierCols;
-  n[1] = fourierRows;	
   if (direction==FFTW_FORWARD) {
     // Perform forward transforms
-		
-    // Put the image into the fourier memory space.
-    // Here, we add some padding.  Reflecting the image seems to be a good
-    // way to fill-in our pad region. 
-    imPtrR = red;
-    imPtrG = green;
-    imPtrB = blue;
-    fftPtrR = (float *)FFT_red;
-    fftPtrG = (float *)FFT_green;
-    fftPtrB = (float *)FFT_blue;
-    for (i=0;i<fourierCols;i++){
-      for (j=0;j<fourierRowsTotal;j++){
-	index = i*fourierRowsTotal+j;
-	if (i<c & j<r){
-	  fftPtrR[index] = *(imPtrR++);
-	  fftPtrG[index] = *(imPtrG++);
-	  fftPtrB[index] = *(imPtrB++);
-	}
-	else{	
-	  // fill this part with a reflection
-	  if (i>c & j>r) reflect = (i-c)*fourierRowsTotal+j-r;
-	  else if (i<c) reflect = i*fourierRowsTotal+j-r;
-	  else reflect = (i-c)*fourierRowsTotal+j;
-	  fftPtrR[index] = fftPtrR[reflect];
-	  fftPtrG[index] = fftPtrG[reflect];
-	  fftPtrB[index] = fftPtrB[reflect];
-	}
-      }
-    }
-
-    plan = fftwf_plan_many_dft_r2c(2, (const int *)&n,
-			       3, // howmany
-			       (float *)FFT_red,
-			       NULL, // inembed
-			       1, // istride
-			       nFourierPix, // idist
-			       (fftwf_complex *)FFT_red,  //(float (*)[2])FFT_red,
-			       NULL, // onembed
-			       1,
-			       nFourierPix/2, // odist
-			       FFTW_ESTIMATE);
-
-    if(plan == NULL) std::cout << "can't create plan - error !!!" << std::endl;
-
-    //fftwf_print_plan(plan);
-    // Have a plan, have some data, now do the forward transforms...
-    //
-    // CRASH HERE
-    // Works fine for howmany=1, but not howmany=3.
-    // I think the problem is that odist (idist for c2r below) is in units 
-    // of fftwf_complex, NOT float.
-    fftwf_execute(plan);
-
-    std::cerr << "nFourierPix=" << nFourierPix << std::endl;
-
-
-    // destroy the plan	
-    //
-    fftwf_destroy_plan(plan);
+    padForFFT(channels);
 
+    fftChannels(FFTW_FORWARD, channels);
 
     // That's it!
 	
   }else{
-    // Doing the back transform. This is similar to the forward one except that there's a division at the end
+    // Doing the back transform
+    // (the image planes are about to be overwritten)
+    hasPendingXform = 0;
 			
-    plan = fftwf_plan_many_dft_c2r(2, (const int *)&n,
-			       3, // howmany
-			       (float (*)[2])FFT_red,
-			       NULL, // inembed
-			       1, // istride
-			       nFourierPix/2, // idist
-			       (float *)FFT_red,
-			       NULL, // onembed
-			       1,
-				   nFourierPix,   // odist
-			       FFTW_ESTIMATE);
-    if(plan == NULL) std::cout << "can't create plan - error !!!" << std::endl;
-
-    // Have a plan, have some data, now do the forward transforms...
-    //
-    fftwf_execute(plan);
-
-    // destroy the plan     
-    //
-    fftwf_destroy_plan(plan);
-    // end if (opened wisdom file)*/
+    fftChannels(FFTW_BACKWARD, channels);
 		
-    // Finally, have to divide all the elements by npix;
-    // Put the image back into into the image memory space, 
-    // dividing by the appropriate scale factor (total number of pixels) along the way...
-    scale = fourierRows*fourierCols;
-    //		scale = npix;
-    imPtrR = red;
-    imPtrG = green;
-    imPtrB = blue;
-    fftPtrR = (float *)FFT_red;
-    fftPtrG = (float *)FFT_green;
-    fftPtrB = (float *)FFT_blue;
-    for (i=0;i<c;i++){
-      for (j=0;j<r;j++){
-	index = i*fourierRowsTotal+j;
-	*(imPtrR++) = fftPtrR[index]/scale;
-	*(imPtrG++) = fftPtrG[index]/scale;
-	*(imPtrB++) = fftPtrB[index]/scale;
+    // Put the image back into the image memory space (staged planes are 
+    // there already; the pad beside them is left as scratch)
+    if (staged) return (1);
+    for (ch=0;ch<3;ch++){
+      if (!(channels & (1<<ch))) continue;
+      imPtr = planes[ch];
+      fftPtr = FFT_red + (long)ch*nFourierPix;
+      for (i=0;i<c;i++){
+	if (planeStorage!=FLOAT32)
+	  packPlane(fftPtr+(long)i*fourierRowsTotal, planes16[ch]+(long)i*r, r, planeStorage);
+	else memcpy(imPtr+(long)i*r, fftPtr+(long)i*fourierRowsTotal, r*sizeof(float));
       }
     }
 
@@ -777,8 +1065,21 @@ int img::doFFT(int direction)
 	
 } // end fn
 
+void img::fftChannels(int direction, int channels)
+{
+  // All three at once where we can; otherwise one at a time
+  int ch;
+  if (channels==7){
+    fftRun(fourierCols, fourierRows, 3, direction, FFT_red);
+    return;
+  }
+  for (ch=0;ch<3;ch++)
+    if (channels & (1<<ch)) 
+      fftRun(fourierCols, fourierRows, 1, direction, FFT_red + (long)ch*nFourierPix);
+}
 
-void img::dotMultiplyFFT(img Multiplier) {
+
+void img::dotMultiplyFFT(const img &Multiplier) {
   // Dot multiply the complex FFT components...
   fftwf_complex tmp, *multR, *multG, *multB, *R, *G, *B;
   int i,j,ij;
@@ -808,50 +1109,142 @@ void img::dotMultiplyFFT(img Multiplier) {
 
 
 
-void img::dotMultiplyFFT(kernelSep Multiplier) 
+// p[i] *= k*w[i], for n floats
+static inline void scaleRow(float *p, const float *w, float k, int n)
 {
-  // Dot multiply the complex FFT components for a row,col separable kernel 
+  int i = 0;
+#ifdef __SSE2__
+  const __m128 kv = _mm_set1_ps(k);
+  for (; i+8<=n; i+=8){
+    _mm_storeu_ps(p+i, _mm_mul_ps(_mm_loadu_ps(p+i), _mm_mul_ps(kv, _mm_loadu_ps(w+i))));
+    _mm_storeu_ps(p+i+4, _mm_mul_ps(_mm_loadu_ps(p+i+4), _mm_mul_ps(kv, _mm_loadu_ps(w+i+4))));
+  }
+#endif
+  for (; i<n; i++) p[i] *= k*w[i];
+}
 
-  fftwf_complex *multColR, *multColG, *multColB, *multRowR, *multRowG, *multRowB;
-  fftwf_complex tmp, *R, *G, *B;
-  int i, j, ij;
-  multColR = (fftwf_complex *)Multiplier.FFT_redColKern;
-  multColG = (fftwf_complex *)Multiplier.FFT_greenColKern;
-  multColB = (fftwf_complex *)Multiplier.FFT_blueColKern;
-  multRowR = (fftwf_complex *)Multiplier.FFT_redRowKern;
-  multRowG = (fftwf_complex *)Multiplier.FFT_greenRowKern;
-  multRowB = (fftwf_complex *)Multiplier.FFT_blueRowKern;
-  R = (fftwf_complex *)FFT_red;
-  G = (fftwf_complex *)FFT_green;
-  B = (fftwf_complex *)FFT_blue;
-  for (i=0;i<fourierRows/2+1;i++){
-    for (j=0;j<fourierCols;j++){
-      ij = (fourierRows/2+1) * j + i;
-      tmp[0] = multRowR[i][0] * R[ij][0] - multRowR[i][1] * R[ij][1]; 
-      tmp[1] = multRowR[i][0] * R[ij][1] + multRowR[i][1] * R[ij][0];
-      tmp[0] = multColR[j][0] * tmp[0] - multColR[j][1] * tmp[1]; 
-      tmp[1] = multColR[j][0] * tmp[1] + multColR[j][1] * tmp[0];
-      R[ij][0] = tmp[0]; R[ij][1] = tmp[1];
-      tmp[0] = multRowG[i][0] * G[ij][0] - multRowG[i][1] * G[ij][1];
-      tmp[1] = multRowG[i][0] * G[ij][1] + multRowG[i][1] * G[ij][0];
-      tmp[0] = multColG[j][0] * tmp[0] - multColG[j][1] * tmp[1];
-      tmp[1] = multColG[j][0] * tmp[1] + multColG[j][1] * tmp[0];
-      G[ij][0] = tmp[0]; G[ij][1] = tmp[1];
-      tmp[0] = multRowB[i][0] * B[ij][0] - multRowB[i][1] * B[ij][1];
-      tmp[1] = multRowB[i][0] * B[ij][1] + multRowB[i][1] * B[ij][0];
-      tmp[0] = multColB[j][0] * tmp[0] - multColB[j][1] * tmp[1];
-      tmp[1] = multColB[j][0] * tmp[1] + multColB[j][1] * tmp[0];
-      B[ij][0] = tmp[0]; B[ij][1] = tmp[1];
-    }
+void img::dotMultiplyFFT(const kernelSep &Multiplier, int channels) 
+{
+  // Dot multiply the complex FFT components for a row,col separable kernel,
+  // for the channels in the mask (as doFFT).
+  // The kernel spectra are real (kernspec.h), so each element is just 
+  // scaled by rowK[i]*colK[j]. The row factors are laid out twice over 
+  // (for the real and imaginary parts), so each row of the spectrum is one
+  // contiguous pass, scaled by its column factor. (The 1/N is in the 
+  // spectra already; see doFFT.)
+
+  const float *multCol[3], *multRow[3];
+  int nh = fourierRows/2+1, i, j, ch;
+  float *rowW;
+  if (FFT_MEMORY_ALLOCATED==0 || Multiplier.FFT_redColKern==NULL) return;
+  rowW = poolAllocFloat(2*nh);
+  if (rowW==NULL) return;
+  multCol[0] = Multiplier.FFT_redColKern;
+  multCol[1] = Multiplier.FFT_greenColKern;
+  multCol[2] = Multiplier.FFT_blueColKern;
+  multRow[0] = Multiplier.FFT_redRowKern;
+  multRow[1] = Multiplier.FFT_greenRowKern;
+  multRow[2] = Multiplier.FFT_blueRowKern;
+  for (ch=0;ch<3;ch++){
+    if (!(channels & (1<<ch))) continue;
+    for (i=0;i<nh;i++) rowW[2*i] = rowW[2*i+1] = multRow[ch][2*i];
+    float *P = FFT_red + (long)ch*nFourierPix;
+    for (j=0;j<fourierCols;j++)
+      scaleRow(P + (long)j*2*nh, rowW, multCol[ch][2*j], 2*nh);
   }
+  poolFree(rowW);
   return;	
 } // end fn
 
+void img::gaussFilter(const gaussSum kern[3], int channels)
+{
+  // Blur each plane with its channel's kernel in real space (iirgauss.h);
+  // the same job as doFFT/dotMultiplyFFT/doFFT, without the padding.
+  // Kernels with terms on pyramid levels (pyramid.h) go that way.
+  // Only the planes in the channels mask (as doFFT) are touched.
+  float *planes[3] = {red, green, blue};
+  unsigned short *planes16[3] = {red16, green16, blue16};
+  int i;
+
+  flushTransforms();
+  if (planeStorage==FLOAT32){
+    for (i=0; i<3; i++)
+      if (channels & (1<<i)) pyramidBlurPlane(planes[i], r, c, getPitch(), kern[i]);
+    return;
+  }
+  // 16-bit planes are widened one at a time
+  float *scratch = poolAllocFloat(npix);
+  for (i=0; i<3; i++){
+    if (!(channels & (1<<i))) continue;
+    unpackPlane(planes16[i], scratch, npix, planeStorage);
+    pyramidBlurPlane(scratch, r, c, r, kern[i]);
+    packPlane(scratch, planes16[i], npix, planeStorage);
+  }
+  poolFree(scratch);
+}
+
+// Multiply a plane's DCT by the separable kernel spectrum
+static void dctMultiply(float *plane, int width, int height, const float *rowK, const float *colK)
+{
+  int i;
+  for (i=0; i<height; i++) scaleRow(plane + (long)i*width, rowK, colK[i], width);
+}
+
+void img::dctFilter(const float kern[3][7], int channels)
+{
+  float *planes[3] = {red, green, blue};
+  unsigned short *planes16[3] = {red16, green16, blue16};
+  float *rowK = new float[3*(r+c)], *colK = rowK + 3*r;
+  int ch, i;
+
+  flushTransforms();
+  // REDFT10 then REDFT01 scale by 2n each way; that's folded into the
+  // spectra (both get scale, as in setKernFFT)
+  for (ch=0; ch<3; ch++){
+    if (!(channels & (1<<ch))) continue;
+    float kW[3] = {kern[ch][0], kern[ch][2], kern[ch][4]}, kSD[3] = {kern[ch][1], kern[ch][3], kern[ch][5]};
+    kernelCosineSpectrum(r, kW, kSD, kern[ch][6]/(2*r), rowK + ch*r);
+    kernelCosineSpectrum(c, kW, kSD, kern[ch][6]/(2*c), colK + ch*c);
+  }
+
+  if (planeStorage==FLOAT32 && !isStagedInFFT() && channels==7){
+    // the three planes are back to back: one batch
+    fftRun(c, r, 3, DCT_FORWARD, red);
+    for (ch=0; ch<3; ch++) dctMultiply(planes[ch], r, c, rowK + ch*r, colK + ch*c);
+    fftRun(c, r, 3, DCT_BACKWARD, red);
+  }else if (planeStorage==FLOAT32 && !isStagedInFFT()){
+    for (ch=0; ch<3; ch++){
+      if (!(channels & (1<<ch))) continue;
+      fftRun(c, r, 1, DCT_FORWARD, planes[ch]);
+      dctMultiply(planes[ch], r, c, rowK + ch*r, colK + ch*c);
+      fftRun(c, r, 1, DCT_BACKWARD, planes[ch]);
+    }
+  }else{
+    // 16-bit or staged planes go through float scratch, one at a time
+    float *scratch = poolAllocFloat(npix);
+    long pitch = getPitch();
+    for (ch=0; ch<3; ch++){
+      if (!(channels & (1<<ch))) continue;
+      if (planeStorage!=FLOAT32) unpackPlane(planes16[ch], scratch, npix, planeStorage);
+      else for (i=0; i<c; i++) memcpy(scratch + (long)i*r, planes[ch] + i*pitch, r*sizeof(float));
+      fftRun(c, r, 1, DCT_FORWARD, scratch);
+      dctMultiply(scratch, r, c, rowK + ch*r, colK + ch*c);
+      fftRun(c, r, 1, DCT_BACKWARD, scratch);
+      if (planeStorage!=FLOAT32) packPlane(scratch, planes16[ch], npix, planeStorage);
+      else for (i=0; i<c; i++) memcpy(planes[ch] + i*pitch, scratch + (long)i*r, r*sizeof(float));
+    }
+    poolFree(scratch);
+  }
+  delete [] rowK;
+}
+
 void img::writeRaw(const char *fileName)
 {
   int i,j,ij;
   FILE *fid;
 
+  flushTransforms();
+
   fid = fopen(fileName, "wt");
   fprintf(fid, "RED:\n");
   for (i=0; i<c; i++){
@@ -917,6 +1310,41 @@ void img::writeRawFFT(const char *fileName)
   return;
 }
 
+void img::assignUcharLinear(unsigned char *dataPtr, const float *tables)
+{
+  // Load 8-bit RGB data through the 9 input tables from 
+  // displayDevice::getInputTables. That does the gamma correction and a 
+  // color transform in one go:
+  //   plane c = table[c*3][R] + table[c*3+1][G] + table[c*3+2][B]
+  // (the sums are in the same order as changeColorSpace, so the result is
+  // the same as assignUchar + applyLookupTable + changeColorSpace)
+  const float *T = tables;
+  float * __restrict rtmp = red;
+  float * __restrict gtmp = green;
+  float * __restrict btmp = blue;
+  int i;
+
+  hasPendingXform = 0;
+  for (i=0; i<npix; i++){
+    int R = dataPtr[3*i], G = dataPtr[3*i+1]+256, B = dataPtr[3*i+2]+512;
+    rtmp[i] = T[R     ] + T[G     ] + T[B     ];
+    gtmp[i] = T[R+ 768] + T[G+ 768] + T[B+ 768];
+    btmp[i] = T[R+1536] + T[G+1536] + T[B+1536];
+  }
+  return;
+}
+
+void img::daltonize(unsigned char *dataPtr, float lumScale, float sScale, float lmStretch){
+  // Same as assignUchar then daltonize, except that the data are loaded
+  // straight into opponent space through the display's input tables.
+  displayDevice myDisp("CRT");
+  float scale = 1.0;
+  if (myDisp.gammaLen()-1 != maxImgVal) scale = 1.0*myDisp.gammaLen()/maxImgVal;
+  assignUcharLinear(dataPtr, myDisp.getInputTables(myDisp.getRGB2OPP(), scale));
+  colorSpaceLabel = OPP;
+  daltonize(lumScale, sScale, lmStretch);
+}
+
 void img::daltonize(float lumScale, float sScale, float lmStretch){
      float xform[16];
      daltonize(lumScale, sScale, lmStretch, xform);
@@ -938,7 +1366,7 @@ void img::daltonize(float lumScale, float sScale, float lmStretch, float *xform)
   case LMS: changeColorSpace(myDisp.getLMS2OPP()); break;
   case RGB: 
     // Apply gamma (transform RGB values to luminance values)
-    applyLookupTable(myDisp.gammaPtrR(), myDisp.gammaPtrG(), myDisp.gammaPtrB());
+    applyLookupTable(myDisp.gammaPtrR(), myDisp.gammaPtrG(), myDisp.gammaPtrB(), myDisp.gammaLen());
     changeColorSpace(myDisp.getRGB2OPP()); 
     break;
   case OPP: break;
@@ -990,5 +1418,5 @@ void img::daltonize(float lumScale, float sScale, float lmStretch, float *xform)
   // Clip out-of-gamut values
   //clipValRange();
   // Apply inverse gamma
-  applyLookupTable(myDisp.invGammaPtrR(), myDisp.invGammaPtrG(), myDisp.invGammaPtrB());
+  applyLookupTable(myDisp.invGammaPtrR(), myDisp.invGammaPtrG(), myDisp.invGammaPtrB(), myDisp.gammaLen());
 }
@@ -21,23 +21,43 @@
 #define HAS_FFT 1
 #define NO_FFT 0
 
+// pad, as a share of each dimension, unless setFourierPad says otherwise
 #define PAD_PROPORTION .05
+// smallest padded FFT dimension
+#define FFT_MIN_SIZE 32
 
-#define forwardPlanFile  "FFT_for_plan.pln"
-#define backwardPlanFile "FFT_back_plan.pln"
+// pixels per block when a queued color transform is folded into another pass
+#define TRANSFORM_BLOCK 2048
 
 // color space labels:
 enum colorSpaceLabelType {RGB, LMS, OPP};
 
+// How the image planes are stored (see img::setPlaneStorage)
+enum planeStorageType {FLOAT32, FLOAT16, BFLOAT16};
+
+// float <-> 16-bit plane values, n at a time
+void packPlane(const float *src, unsigned short *dst, int n, planeStorageType t);
+void unpackPlane(const unsigned short *src, float *dst, int n, planeStorageType t);
+
 
 class img;
+struct gaussSum;
+template<class Space, class Observer, bool Spatial> struct simPipeline;
 
 class img {
+	// the specialized pipelines (pipeline.h) work on the planes directly
+	template<class Space, class Observer, bool Spatial> friend struct simPipeline;
 protected:
 	float *red;
 	float *green;
 	float *blue;
 
+	// The same planes when they are stored in 16 bits (otherwise NULL)
+	unsigned short *red16;
+	unsigned short *green16;
+	unsigned short *blue16;
+	planeStorageType planeStorage;
+
 	// These planes hold FFT data only
 	float *FFT_red;
 	float *FFT_green;
@@ -45,75 +65,153 @@ protected:
 
 	int r, c;
 	int fourierRows, fourierCols, fourierRowsTotal;
+	int padRows, padCols;	// asked for by setFourierPad, -1 for none
 	int npix, nFourierPix;
 	float maxImgVal;
 	int FFT_MEMORY_ALLOCATED; // Memory for the FFT data is allocated by the constructor only if required
+	int fftBorrowed;	// the FFT buffer is the caller's (stageInFFT(float *))
+	void setFourierSize();
 	int allocateFFTspace();
+	void fftChannels(int direction, int channels);
+	void freeBuffers();
+	void takeBuffers(img &other);
+
+	// Queued (not yet applied) color transform: row-major 3x3 plus offset column
+	float pendingXform[12];
+	int hasPendingXform;
+	void resetTransform();
+	void queueTransform(const float A[9], const float t[3]);
+	void applyTransformBlock(int start, int n);
+	void brettelPass(float *x, float *y, float *out, float inflectionVal,
+			 float k1x, float k1y, float k2x, float k2y);
 public:
-	img() {}
+	img() {hasPendingXform = 0; planeStorage = FLOAT32; red = green = blue = NULL;
+	       red16 = green16 = blue16 = NULL; FFT_red = FFT_green = FFT_blue = NULL;
+	       FFT_MEMORY_ALLOCATED = 0; fourierRows = fourierCols = nFourierPix = 0;
+	       padRows = padCols = -1; fftBorrowed = 0;}
 	img(int rows, int cols);
 	img(int rows, int cols, float maxImageValue);
 	img(int rows, int cols, int hasFFT); // Can explicitly allocate FFT space on construction
 	~img();
 
+	// An img owns its buffers, so it can be moved but not copied.
+	img(const img &) = delete;
+	img &operator=(const img &) = delete;
+	img(img &&other);
+	img &operator=(img &&other);
+
 	colorSpaceLabelType colorSpaceLabel;
 
 	int getRows() {return r;}
 	int getCols() {return c;}
-	int getFourierRows() {return fourierRows;}
-	int getFourierCols() {return fourierCols;}
+	// The padded size is worked out when first asked for
+	int getFourierRows() {if (!fourierRows) setFourierSize(); return fourierRows;}
+	int getFourierCols() {if (!fourierRows) setFourierSize(); return fourierCols;}
+	// floats in each plane's share of the FFT buffer
+	int getFourierPix() {if (!fourierRows) setFourierSize(); return nFourierPix;}
+	// Pad each line by at least rowPad samples and each column by colPad
+	// (before rounding up to a good FFT size) instead of PAD_PROPORTION.
+	// doFFT fills the first half of a pad with the line's end mirrored and
+	// the second half with its start, so going round the period each edge
+	// meets its own reflection. Only before the FFT space is allocated.
+	void setFourierPad(int rowPad, int colPad);
 	int getNpix() {return npix;}
 	float getMaxImgVal() {return maxImgVal;}
 
+	// FLOAT16/BFLOAT16 halve the memory (and the bytes moved) for the 
+	// planes. Only the specialized pipelines (pipeline.h) and doFFT read 
+	// and write 16-bit planes; everything else wants FLOAT32. Any pixel 
+	// values are lost.
+	void setPlaneStorage(planeStorageType t);
+	planeStorageType getPlaneStorage() {return planeStorage;}
+
+	// Staging: the (float) planes become the first r samples of each 
+	// fourierRowsTotal-long row of the FFT buffer, so doFFT transforms 
+	// them in place and the result lands back in them, with no copies in 
+	// or out. Their contents are lost, so stage before loading. Set the 
+	// pad first. Only the specialized pipelines, gaussFilter and doFFT 
+	// know about the longer pitch. Returns 0 (nothing done) for 16-bit 
+	// planes or when there's no memory for the FFT.
+	int stageInFFT();
+	// The same in a buffer of the caller's (3*getFourierPix() floats, 
+	// planes one after the other), which must outlive the img. Several 
+	// images side by side in one buffer can then go through fftRun 
+	// together (runSimulation's frame groups).
+	int stageInFFT(float *buffer);
+	int isStagedInFFT() {return red!=NULL && red==FFT_red;}
+	// floats from one row of a plane to the next
+	int getPitch() {return isStagedInFFT() ? fourierRowsTotal : r;}
+
 	void assignUchar(unsigned char *dataPtr);
 	void extractUchar(unsigned char *dataPtr);
 
 	void assignUchar(unsigned char *dataPtr, const float scale);
 	void extractUchar(unsigned char *dataPtr, const float scale);
 
+	// Gamma + color transform on the way in (tables from displayDevice::getInputTables)
+	void assignUcharLinear(unsigned char *dataPtr, const float *tables);
+
 	float getRedVal(const int row, const int col) 
-			{if ((row<r)&&(row>=0)&&(col<c)&&(col>=0)) return red[row*c+col]; else return -999;}
+			{flushTransforms(); if ((row<r)&&(row>=0)&&(col<c)&&(col>=0)) return red[row*c+col]; else return -999;}
 	float getGreenVal(const int row, const int col) 
-			{if ((row<r)&&(row>=0)&&(col<c)&&(col>=0)) return green[row*c+col]; else return -999;}
+			{flushTransforms(); if ((row<r)&&(row>=0)&&(col<c)&&(col>=0)) return green[row*c+col]; else return -999;}
 	float getBlueVal(const int row, const int col) 
-			{if ((row<r)&&(row>=0)&&(col<c)&&(col>=0)) return blue[row*c+col]; else return -999;}
+			{flushTransforms(); if ((row<r)&&(row>=0)&&(col<c)&&(col>=0)) return blue[row*c+col]; else return -999;}
 
 	float getRedVal(const int pixnum) 
-			{if ((pixnum<npix)&&(pixnum>=0)) return red[pixnum]; else return -999;}
+			{flushTransforms(); if ((pixnum<npix)&&(pixnum>=0)) return red[pixnum]; else return -999;}
 	float getGreenVal(const int pixnum) 
-			{if ((pixnum<npix)&&(pixnum>=0)) return green[pixnum]; else return -999;}
+			{flushTransforms(); if ((pixnum<npix)&&(pixnum>=0)) return green[pixnum]; else return -999;}
 	float getBlueVal(const int pixnum) 
-			{if ((pixnum<npix)&&(pixnum>=0)) return blue[pixnum]; else return -999;}
+			{flushTransforms(); if ((pixnum<npix)&&(pixnum>=0)) return blue[pixnum]; else return -999;}
 
 	void setRedVal(const int row, const int col, float val) 
-			{if ((row<r)&&(row>=0)&&(col<c)&&(col>=0)) red[row*c+col] = val;}
+			{flushTransforms(); if ((row<r)&&(row>=0)&&(col<c)&&(col>=0)) red[row*c+col] = val;}
 	void setGreenVal(const int row, const int col, float val) 
-			{if ((row<r)&&(row>=0)&&(col<c)&&(col>=0)) green[row*c+col] = val;}
+			{flushTransforms(); if ((row<r)&&(row>=0)&&(col<c)&&(col>=0)) green[row*c+col] = val;}
 	void setBlueVal(const int row, const int col, float val) 
-			{if ((row<r)&&(row>=0)&&(col<c)&&(col>=0)) blue[row*c+col] = val;}
+			{flushTransforms(); if ((row<r)&&(row>=0)&&(col<c)&&(col>=0)) blue[row*c+col] = val;}
 
 	void setRedVal(const int pixnum, float val) 
-			{if ((pixnum<npix)&&(pixnum>=0)) red[pixnum] = val;}
+			{flushTransforms(); if ((pixnum<npix)&&(pixnum>=0)) red[pixnum] = val;}
 	void setGreenVal(const int pixnum, float val) 
-			{if ((pixnum<npix)&&(pixnum>=0)) green[pixnum] = val;}
+			{flushTransforms(); if ((pixnum<npix)&&(pixnum>=0)) green[pixnum] = val;}
 	void setBlueVal(const int pixnum, float val) 
-			{if ((pixnum<npix)&&(pixnum>=0)) blue[pixnum] = val;}
+			{flushTransforms(); if ((pixnum<npix)&&(pixnum>=0)) blue[pixnum] = val;}
 
+	// Color-space changes are queued and composed; flushTransforms() applies
+	// them now (the nonlinear stages below do this themselves).
 	void changeColorSpace(float transformMatrix[]);
 	void changeColorSpace4Matrix(float tm[]);
+	void flushTransforms();
 
 	void applyLookupTable(float *tableR, float *tableG, float *tableB);
+	void applyLookupTable(float *tableR, float *tableG, float *tableB, int tableLen);
 	void clipValRange();
 	void scaleValRange();
 
 	void brettelTransform(char viewerType, float rgb2lms[]);
+	static int brettelParams(char viewerType, const float rgb2lms[], float params[5]);
 
 	void computeDaltonize(float outMat[], float lmStretch, float lumScale, float sScale);
 	void daltonize(float lumScale, float sScale, float lmStretch);
+	void daltonize(unsigned char *dataPtr, float lumScale, float sScale, float lmStretch);
 	void daltonize(float lumScale, float sScale, float lmStretch, float *xform);
-	int doFFT(int direction);
-	void dotMultiplyFFT(img Multiplier);
-	void dotMultiplyFFT(class kernelSep Multiplier);
+	// channels is a mask of the planes to work on (1 = red, 2 = green, 
+	// 4 = blue); any others are left as they are
+	int doFFT(int direction, int channels = 7);
+	// doFFT's forward half without the transform: the planes into the FFT
+	// buffer, the pad filled, for whoever runs the transforms themselves
+	void padForFFT(int channels = 7);
+	void dotMultiplyFFT(const img &Multiplier);
+	void dotMultiplyFFT(const class kernelSep &Multiplier, int channels = 7);
+	// Real-space alternative to the three above, one kernel per plane
+	void gaussFilter(const gaussSum kern[3], int channels = 7);
+	// Or by DCT: each plane's mirrored-edge convolution with the kernel 
+	// kern[ch] (setKernFFT's kW1,kSD1,kW2,kSD2,kW3,kSD3,scale) is a DCT-II, 
+	// a multiply by the kernel's cosine spectrum and a DCT-III. No pad, 
+	// no FFT buffer; the planes are transformed where they are.
+	void dctFilter(const float kern[3][7], int channels = 7);
 
 	void writeRaw(const char *fileName);
 	void writeRawFFT(const char *fileName);
@@ -1,10 +1,13 @@
 #include "imglib.h"
 #include "kernlib.h"
+#include "bufpool.h"
+#include "kernspec.h"
 #include <stdlib.h>
 #include <math.h>
 #include <iostream>
 #include <string>
 #include <fstream>
+#include <utility>
 #include <fftw3.h>
 
 // -------------
@@ -22,7 +25,7 @@ kernel::kernel(int rows, int cols, int hasFFT)
 	
   // Allocate one big block of memory, then divy it up ourselves.
   // (makes processor caching more effective? seems to provide ~ 20% speed gain.)
-  red = new float [npix*3];
+  red = poolAllocFloat(npix*3);
   green = red+npix;
   blue = green+npix;
 	
@@ -184,69 +187,81 @@ kernelSep::kernelSep(int rows, int cols)
   int totalRows = fourierRowsComplex*2;
   int totalCols = fourierColsComplex*2;
 
-  FFT_redColKern = new float [totalCols*3];
+  FFT_redColKern = poolAllocFloat(totalCols*3);
   FFT_greenColKern = FFT_redColKern+totalCols;
   FFT_blueColKern = FFT_greenColKern+totalCols;
-  FFT_redRowKern = new float [totalRows*3];
+  FFT_redRowKern = poolAllocFloat(totalRows*3);
   FFT_greenRowKern = FFT_redRowKern+totalRows;
   FFT_blueRowKern = FFT_greenRowKern+totalRows;
 	
   if (FFT_redColKern==NULL || FFT_redRowKern==NULL){
     std::cerr<<"Memory Error in kernelSep!"<<std::endl;
+    poolFree(FFT_redColKern);
+    poolFree(FFT_redRowKern);
     fourierRows = fourierCols = fourierRowsComplex = fourierColsComplex = 0;
-    FFT_redRowKern=FFT_greenColKern=FFT_greenRowKern=FFT_blueColKern=FFT_blueRowKern=NULL;
+    FFT_redColKern=FFT_redRowKern=FFT_greenColKern=FFT_greenRowKern=FFT_blueColKern=FFT_blueRowKern=NULL;
   }
 
   return;
 }
 
-//kernelSep::~kernelSep(void)
-//{
-  // The following cause a segmentation fault in main when imageMagick tries to
-  // write the outSimFile.  Very weird!
-  //  delete FFT_redRowKern;
-  //  delete FFT_greenRowKern;
-  //  delete FFT_blueRowKern;
-  //  delete FFT_redColKern;
-  //  delete FFT_greenColKern;
-  //  delete FFT_blueColKern;
-//  return;
-//}
-
+kernelSep::~kernelSep()
+{
+  // the three col (and row) kernels are one block each
+  poolFree(FFT_redColKern);
+  poolFree(FFT_redRowKern);
+}
 
-void kernelSep::setKernFFT(int kNum, float kW1, float kSD1, float kW2, float kSD2, float kW3, float kSD3, float scale)
+kernelSep::kernelSep(kernelSep &&other)
 {
-  // prototype  F-space kernel generation routine for the row,col separable kernel
-  fftwf_plan plan;
-  int i;
-  float kSD1sq,kSD2sq,kSD3sq,center,d;
-  float totalSum;
-  float *kPtr, *thisKernel;
+  FFT_redColKern = NULL;
+  FFT_redRowKern = NULL;
+  *this = std::move(other);
+}
 
-  // remember which kernel we're supposed to work on:
-  if (kNum==1) thisKernel = (float *)FFT_redColKern;
-  else if (kNum==2) thisKernel = (float *)FFT_greenColKern;
-  else thisKernel = (float *)FFT_blueColKern;
+kernelSep &kernelSep::operator=(kernelSep &&other)
+{
+  if (this == &other) return *this;
+  poolFree(FFT_redColKern);
+  poolFree(FFT_redRowKern);
+  FFT_redColKern = other.FFT_redColKern;
+  FFT_greenColKern = other.FFT_greenColKern;
+  FFT_blueColKern = other.FFT_blueColKern;
+  FFT_redRowKern = other.FFT_redRowKern;
+  FFT_greenRowKern = other.FFT_greenRowKern;
+  FFT_blueRowKern = other.FFT_blueRowKern;
+  fourierRows = other.fourierRows;
+  fourierCols = other.fourierCols;
+  fourierRowsComplex = other.fourierRowsComplex;
+  fourierColsComplex = other.fourierColsComplex;
+  other.FFT_redColKern = other.FFT_greenColKern = other.FFT_blueColKern = NULL;
+  other.FFT_redRowKern = other.FFT_greenRowKern = other.FFT_blueRowKern = NULL;
+  other.fourierRows = other.fourierCols = other.fourierRowsComplex = other.fourierColsComplex = 0;
+  return *this;
+}
 
-  // avoid divide-by-zero:
-  if (kSD1==0.0) kSD1 = 0.001;
-  if (kSD2==0.0) kSD2 = 0.001;
-  if (kSD3==0.0) kSD3 = 0.001;
 
-  kSD1sq = 2*kSD1*kSD1;
-  kSD2sq = 2*kSD2*kSD2;
-  kSD3sq = 2*kSD3*kSD3;
+void kernelSep::setKernFFT(int kNum, float kW1, float kSD1, float kW2, float kSD2, float kW3, float kSD3, float scale)
+{
+  // F-space kernel generation for the row,col separable kernel.
+  // The spectra of the sampled Gaussians are worked out directly (and 
+  // cached) by kernelSpectrum; see kernspec.h.
+  float kW[3] = {kW1, kW2, kW3}, kSD[3] = {kSD1, kSD2, kSD3};
+  float *colKernel, *rowKernel;
 
-  // avoid divide-by-zero:
-  if (kSD1sq==0.0) kSD1sq = 0.0001;
-  if (kSD2sq==0.0) kSD2sq = 0.0001;
-  if (kSD3sq==0.0) kSD3sq = 0.0001;	
+  if (FFT_redColKern==NULL) return;	// out of memory (see the constructor)
 
-  // Normalize weights of the Gaussian components by sqrt(4*pi)*SD (= 3.544907701811*SD), 
-  // so that the incomming weight specifies the true height of a unit-area (1d) gaussian.
-  kW1 /= 3.544907701811*kSD1;
-  kW2 /= 3.544907701811*kSD2;
-  kW3 /= 3.544907701811*kSD3;
+  // remember which kernel we're supposed to work on:
+  if (kNum==1){
+    colKernel = FFT_redColKern;
+    rowKernel = FFT_redRowKern;
+  }else if (kNum==2){
+    colKernel = FFT_greenColKern;
+    rowKernel = FFT_greenRowKern;
+  }else{
+    colKernel = FFT_blueColKern;
+    rowKernel = FFT_blueRowKern;
+  }
 
   // Normalization of the final kernel to power = (1/sqrt(2))*scale 
   // (sqrt(2)=1.414213562373). It's this rather than 1*scale because 
@@ -256,99 +271,41 @@ void kernelSep::setKernFFT(int kNum, float kW1, float kSD1, float kW2, float kSD
   // original SCIE lab).
   //scale /= 1.414213562373;
 
-  // Compute the column kernel...
-  kPtr = thisKernel;
-  center = 0.5*fourierCols+0.5;	
-  totalSum = 0.0;
-  for (i=0;i<fourierCols;i++){
-    d = center-fabs(i-center);
-    d *= d;
-    *kPtr = (kW1*exp(-d/kSD1sq) + kW2*exp(-d/kSD2sq) + kW3*exp(-d/kSD3sq)); 
-    totalSum += *kPtr++;
-    *kPtr++ = 0.0;	// the pad value
-  }
-  kPtr = thisKernel;
-  //std::cerr << "scale=" << scale << "; totalSum=" << totalSum << std::endl;
-  totalSum = scale/fabs(totalSum);
-  for (i=0;i<fourierCols;i++){
-    *kPtr++ *= totalSum; 
-    kPtr++;	// skip the pad value
-  }
-  // Column kernel FFT:	
-  plan = fftwf_plan_dft_r2c_2d(fourierCols,1,(float *)thisKernel,(float (*)[2])thisKernel,FFTW_ESTIMATE);
-
-  if(plan == NULL){
-    std::cerr << "can't create plan - error !!!" << std::endl;
-    exit(0);
-  }
-  fftwf_execute(plan);
-  fftwf_destroy_plan(plan);
-
-  // Now the row kernel...
-  // Remember, the row dimention is half-complex, so there is no pad value to deal with
-  if (kNum==1) thisKernel = (float *)FFT_redRowKern;
-  else if (kNum==2) thisKernel = (float *)FFT_greenRowKern;
-  else thisKernel = (float *)FFT_blueRowKern;
-  kPtr = thisKernel;
-  center = 0.5*fourierRows+.5;
-  totalSum = 0.0;
-  for (i=0;i<fourierRows;i++){
-    d = center-fabs(i-center);
-    d *= d;
-    *kPtr = (kW1*exp(-d/kSD1sq) + kW2*exp(-d/kSD2sq) + kW3*exp(-d/kSD3sq)); 
-    totalSum += *kPtr++;
-  }
-  kPtr = thisKernel;
-  totalSum = scale/fabs(totalSum);
-  // do normalization to power = 1*scale
-  for (i=0;i<fourierRows;i++){
-    *kPtr++ *= totalSum; 
-  }
-	 
-  // Row kernel FFT
-  plan = fftwf_plan_dft_r2c_2d(1,fourierRows,(float *)thisKernel,(float (*)[2])thisKernel,FFTW_ESTIMATE);
-  if(plan == NULL){
-    std::cerr << "can't create plan - error !!!" << std::endl;
-    exit(0);
-  }
-  fftwf_execute(plan);
-  fftwf_destroy_plan(plan);
+  // The column kernel is a full complex transform; the row dimension is 
+  // half-complex. img::doFFT doesn't normalize its transforms, so each 
+  // also takes 1/its length.
+  kernelSpectrum(fourierCols, fourierColsComplex, kW, kSD, scale/fourierCols, colKernel);
+  kernelSpectrum(fourierRows, fourierRowsComplex, kW, kSD, scale/fourierRows, rowKernel);
 }
 
 void kernelSep::writeRawFFT(const char *fileName)
 {
-  int i;
+  // The spectra are real (kernspec.h), so only the real parts are written:
+  // per channel, the fourierCols column factors, then the 
+  // fourierRowsComplex row factors. (Each has 1/its length in it; see
+  // setKernFFT.)
+  const char *names[3] = {"RED", "GREEN", "BLUE"};
+  float *colKern[3] = {FFT_redColKern, FFT_greenColKern, FFT_blueColKern};
+  float *rowKern[3] = {FFT_redRowKern, FFT_greenRowKern, FFT_blueRowKern};
+  int i, ch;
   FILE *fid;
 
   fid = fopen(fileName, "wt");
-  fprintf(fid, "RED:\n");
-  for (i=0; i<fourierCols*2; i++){
-    fprintf(fid, "%.4f\t",FFT_redColKern[i]);
+  if (fid==NULL || FFT_redColKern==NULL){
+    if (fid) fclose(fid);
+    return;
   }
-  fprintf(fid,"\n");
-  for (i=0; i<2*(fourierRows/2+1); i++){
-    fprintf(fid, "%.4f\t",FFT_redRowKern[i]);
-  }
-
-  fprintf(fid, "\nGREEN:\n");
-  for (i=0; i<fourierCols*2; i++){
-    fprintf(fid, "%.4f\t",FFT_greenColKern[i]);
-  }
-  fprintf(fid,"\n");
-  for (i=0; i<2*(fourierRows/2+1); i++){
-    fprintf(fid, "%.4f\t",FFT_greenRowKern[i]);
-  }
-
-  fprintf(fid, "\nBLUE:\n");
-  for (i=0; i<fourierCols*2; i++){
-    fprintf(fid, "%.4f\t",FFT_blueColKern[i]);
-  }
-  fprintf(fid,"\n");
-  for (i=0; i<2*(fourierRows/2+1); i++){
-    fprintf(fid, "%.4f\t",FFT_blueRowKern[i]);
+  for (ch=0; ch<3; ch++){
+    fprintf(fid, "%s%s:\n", ch ? "\n" : "", names[ch]);
+    for (i=0; i<fourierColsComplex; i++){
+      fprintf(fid, "%.6g\t",colKern[ch][2*i]);
+    }
+    fprintf(fid,"\n");
+    for (i=0; i<fourierRowsComplex; i++){
+      fprintf(fid, "%.6g\t",rowKern[ch][2*i]);
+    }
   }
   fprintf(fid,"\n");
   fclose(fid);
   return;
 }
-
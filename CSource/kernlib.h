@@ -32,7 +32,13 @@ class kernelSep{
  public:
 
   kernelSep(int rows, int cols);
-  //kernelSep::~kernelSep(void);
+  ~kernelSep();
+
+  // owns its spectra: movable, not copyable (see img)
+  kernelSep(const kernelSep &) = delete;
+  kernelSep &operator=(const kernelSep &) = delete;
+  kernelSep(kernelSep &&other);
+  kernelSep &operator=(kernelSep &&other);
 
   void setKernFFT(int kNum, float kW1, float kSD1, float kW2, float kSD2, float kW3, float kSD3, float scale);
 
@@ -0,0 +1,229 @@
+#include "kernspec.h"
+#include <math.h>
+#include <pthread.h>
+#include <iostream>
+
+struct specEntry {
+  int n, nOut, wrap;
+  float kW[3], kSD[3], scale;
+  float *re;		// nOut real parts
+  specEntry *prev, *next;
+};
+
+// Most recently used first
+static specEntry *head = NULL, *tail = NULL;
+static int entries = 0;
+static kernSpecStats stats;
+static pthread_mutex_t specLock = PTHREAD_MUTEX_INITIALIZER;
+
+static const double TWO_PI = 6.283185307180;
+
+// The DTFT of exp(-j^2/(2 sd^2)) over all integers j, at w in [0, pi]
+static double gaussDTFT(double sd, double w)
+{
+  double s = 0.0, e;
+  int j, k;
+
+  if (sd < 1.0){
+    // out to where the taps are below 1e-16
+    s = 1.0;
+    for (j=1; j<=(int)ceil(8.6*sd); j++) s += 2.0*exp(-j*j/(2.0*sd*sd))*cos(w*j);
+    return s;
+  }
+  // the aliases at k = +-1 (and +-2) only count for SDs of a few pixels
+  // (under 3, the nearest is still above 1e-19)
+  int K = (sd < 3.0) ? 2 : 0;
+  for (k=-K; k<=K; k++){
+    e = sd*(w-TWO_PI*k);
+    e *= 0.5*e;
+    if (e < 80.0) s += exp(-e);
+  }
+  return 2.506628274631*sd*s;	// sqrt(2*pi)*sd
+}
+
+// Frequencies per pass of tailSums
+#define TAIL_BLOCK 8
+
+// s[k] = sum over j of taps[j]*cos((w0+k*dw)*(j0+j)), j = 0..len-1, for
+// k = 0..TAIL_BLOCK-1, by the Chebyshev recurrence (no trig per tap). 
+// The frequencies go side by side, so the loop vectorizes.
+static void tailSums(const double *taps, int len, int j0, double w0, double dw, double *s)
+{
+  double c0[TAIL_BLOCK], c1[TAIL_BLOCK], twoCos[TAIL_BLOCK], c2;
+  int j, k;
+
+  for (k=0; k<TAIL_BLOCK; k++){
+    double w = w0+k*dw;
+    c0[k] = cos(w*j0);
+    c1[k] = cos(w*(j0+1));
+    twoCos[k] = 2.0*cos(w);
+    s[k] = 0.0;
+  }
+  for (j=0; j<len; j++){
+    for (k=0; k<TAIL_BLOCK; k++){
+      s[k] += taps[j]*c0[k];
+      c2 = twoCos[k]*c1[k] - c0[k];
+      c0[k] = c1[k];
+      c1[k] = c2;
+    }
+  }
+}
+
+static void makeSpectrum(specEntry *e)
+{
+  double a[3], sd[3], total = 0.0, v, w, d;
+  double *tailTaps = NULL, tail[TAIL_BLOCK];
+  int t, f, j, nt = 0, half = e->n/2, far = 0, tailLen = 0, tail0 = 0;
+
+  for (t=0; t<3; t++){
+    if (e->kW[t]==0.0) continue;
+    sd[nt] = (e->kSD[t]==0.0) ? 0.001 : e->kSD[t];
+    a[nt] = e->kW[t]/sd[nt];
+    total += a[nt]*gaussDTFT(sd[nt], 0.0);
+    if ((int)ceil(8.6*sd[nt]) > far) far = (int)ceil(8.6*sd[nt]);
+    nt++;
+  }
+  tail0 = (e->n % 2) ? half+1 : half;
+  if (!e->wrap && far >= tail0){
+    // The kernel is cut to one period, not wrapped round it, so the taps
+    // the neighbouring periods bring in are taken off again: those past
+    // n/2 each side (and for an even n one of the two at n/2), each
+    // counted twice for the two sides. Out to 8.6 SD (below 1e-16).
+    tailLen = far-tail0+1;
+    tailTaps = new double[tailLen];
+    for (j=0; j<tailLen; j++){
+      d = tail0+j;
+      tailTaps[j] = 0.0;
+      for (t=0; t<nt; t++) tailTaps[j] += a[t]*exp(-d*d/(2.0*sd[t]*sd[t]));
+      if (j > 0 || e->n % 2) tailTaps[j] *= 2.0;
+      total -= tailTaps[j];
+    }
+  }
+  total = fabs(total);
+  if (total==0.0) total = 1.0;
+  // The spectrum is symmetric (f and n-f match), so only up to n/2 is
+  // worked out
+  for (f=0; f<e->nOut; f++){
+    if (f > half){
+      e->re[f] = e->re[e->n-f];
+      continue;
+    }
+    w = TWO_PI*f/e->n;
+    v = 0.0;
+    for (t=0; t<nt; t++) v += a[t]*gaussDTFT(sd[t], w);
+    if (tailTaps){
+      if (f % TAIL_BLOCK == 0) tailSums(tailTaps, tailLen, tail0, w, TWO_PI/e->n, tail);
+      v -= tail[f % TAIL_BLOCK];
+    }
+    e->re[f] = e->scale*v/total;
+  }
+  delete [] tailTaps;
+}
+
+static void detach(specEntry *e)
+{
+  if (e->prev) e->prev->next = e->next; else head = e->next;
+  if (e->next) e->next->prev = e->prev; else tail = e->prev;
+}
+
+static void pushFront(specEntry *e)
+{
+  e->prev = NULL;
+  e->next = head;
+  if (head) head->prev = e; else tail = e;
+  head = e;
+}
+
+// The cached spectrum (made if need be), most recently used now.
+// specLock must be held.
+static specEntry *lookup(int n, int nOut, int wrap, const float kW[3], const float kSD[3], float scale)
+{
+  specEntry *e;
+  int i;
+
+  for (e=head; e; e=e->next){
+    if (e->n==n && e->nOut==nOut && e->wrap==wrap && e->scale==scale &&
+	e->kW[0]==kW[0] && e->kW[1]==kW[1] && e->kW[2]==kW[2] &&
+	e->kSD[0]==kSD[0] && e->kSD[1]==kSD[1] && e->kSD[2]==kSD[2]) break;
+  }
+  if (e){
+    stats.hits++;
+    detach(e);
+  }else{
+    // a new one, or the least recently used one made over
+    if (entries < KERNSPEC_CACHE_SIZE){
+      e = new specEntry;
+      e->re = NULL;
+      entries++;
+    }else{
+      e = tail;
+      detach(e);
+    }
+    if (e->re==NULL || e->nOut!=nOut){
+      delete [] e->re;
+      e->re = new float[nOut];
+    }
+    e->n = n; e->nOut = nOut; e->wrap = wrap; e->scale = scale;
+    for (i=0; i<3; i++){
+      e->kW[i] = kW[i];
+      e->kSD[i] = kSD[i];
+    }
+    makeSpectrum(e);
+    stats.made++;
+  }
+  pushFront(e);
+  return e;
+}
+
+void kernelSpectrum(int n, int nOut, const float kW[3], const float kSD[3], float scale, float *out)
+{
+  specEntry *e;
+  int i;
+
+  pthread_mutex_lock(&specLock);
+  e = lookup(n, nOut, 0, kW, kSD, scale);
+  for (i=0; i<nOut; i++){
+    out[2*i] = e->re[i];
+    out[2*i+1] = 0.0;
+  }
+  pthread_mutex_unlock(&specLock);
+}
+
+void kernelCosineSpectrum(int n, const float kW[3], const float kSD[3], float scale, float *out)
+{
+  specEntry *e;
+  int i;
+
+  pthread_mutex_lock(&specLock);
+  e = lookup(2*n, n, 1, kW, kSD, scale);
+  for (i=0; i<n; i++) out[i] = e->re[i];
+  pthread_mutex_unlock(&specLock);
+}
+
+void kernSpecGetStats(kernSpecStats &s)
+{
+  pthread_mutex_lock(&specLock);
+  s = stats;
+  pthread_mutex_unlock(&specLock);
+}
+
+void kernSpecPrintStats()
+{
+  kernSpecStats s;
+  kernSpecGetStats(s);
+  std::cerr << "kernel spectra: " << s.made << " made, " << s.hits << " reused" << std::endl;
+}
+
+void kernSpecForget()
+{
+  pthread_mutex_lock(&specLock);
+  while (head){
+    specEntry *e = head;
+    head = e->next;
+    delete [] e->re;
+    delete e;
+  }
+  tail = NULL;
+  entries = 0;
+  pthread_mutex_unlock(&specLock);
+}
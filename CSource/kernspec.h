@@ -0,0 +1,58 @@
+#ifndef __kernspec_h
+#define __kernspec_h
+
+/*
+ *    Kernel spectra, worked out analytically and cached.
+ *
+ *    kernelSep::setKernFFT used to sample each 1-D sum of Gaussians out to
+ *    the period and FFT it. The DFT of a sampled Gaussian wrapped round a
+ *    period of n has a closed form. By Poisson summation, at w = 2*pi*f/n,
+ *
+ *      sum over j of exp(-j^2/(2 sd^2)) exp(-i w j)
+ *        = sqrt(2 pi) sd * sum over k of exp(-sd^2 (w - 2 pi k)^2 / 2)
+ *
+ *    It's real (the kernel is symmetric about 0) and includes the
+ *    wrap-around from the neighbouring periods. Narrow terms (SD under 1)
+ *    take the left-hand sum instead, which is only a few taps long.
+ *
+ *    setKernFFT's kernel is not wrapped, though: it is cut off half a
+ *    period each side of 0. So for kernelSpectrum the taps past that, out
+ *    to where they drop below 1e-16, are summed as cosines and taken off
+ *    again. That only happens for terms wider than about n/17. The DCT's
+ *    mirrored line really is periodic, so kernelCosineSpectrum keeps the
+ *    wrap. checkKernSpec (make check) compares both with a DFT of the
+ *    sampled kernel.
+ *
+ *    The same kernels come round again and again, so the spectra are kept
+ *    in a small LRU cache, keyed by the period, the output length, the
+ *    weights, the SDs (in pixels, so sampPerDeg is in them) and the scale.
+ *    Thread safe.
+ */
+
+// Spectra kept
+#define KERNSPEC_CACHE_SIZE 32
+
+// The first nOut DFT coefficients, over a period of n, of the kernel
+// setKernFFT describes: terms of weight kW[t]/kSD[t] (SD 0 taken as
+// 0.001), sampled at -n/2 < j <= n/2, the whole scaled to sum to scale.
+// Written to out as nOut interleaved complex values (the imaginary parts
+// are 0).
+void kernelSpectrum(int n, int nOut, const float kW[3], const float kSD[3], float scale, float *out);
+
+// The same kernel's multipliers for a DCT-II (FFTW's REDFT10) of a line of
+// n mirrored at its ends (half-sample symmetric): its spectrum over the
+// period 2n of the line and its mirror image, at f = 0..n-1. Written to
+// out as n reals.
+void kernelCosineSpectrum(int n, const float kW[3], const float kSD[3], float scale, float *out);
+
+struct kernSpecStats {
+  int made;		// cache misses
+  int hits;
+};
+void kernSpecGetStats(kernSpecStats &s);
+void kernSpecPrintStats();	// to cerr
+
+// Empty the cache
+void kernSpecForget();
+
+#endif // __kernspec_h
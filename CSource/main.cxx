@@ -1,14 +1,21 @@
 #include <time.h>
 #include "runSimulation.h"
+#include "bufpool.h"
+#include "fftplan.h"
+#include "kernspec.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <getopt.h>
+#include <unistd.h>
 #include <iostream>
 #include <string>
 
 const unsigned int jpegQuality = 82;
 
 void printHelp(void);
+int readFrames(unsigned char *data, int x, int y, int frames, char dataType, long *cut);
+void writeFrames(const unsigned char *data, int x, int y, int frames, char dataType);
 
 int main(int argc, char **argv){
   // vischeck parameters
@@ -19,7 +26,11 @@ int main(int argc, char **argv){
   char *sensorType="normal";
   char *simDisp="CRT";
   char *viewDisp="CRT";
-  clock_t startTicks;
+  const char *wisdomFile = NULL;
+  int fftThreads = 1;
+  int frames = 1, group = 1;
+  char trailing;
+  clock_t startTicks, busyTicks = 0;
   float vischeckSecs;
   float kernelWt[9];
   float kernelSD[9]; 
@@ -41,10 +52,28 @@ int main(int argc, char **argv){
   int x=1,y=1;
   int c;
   bool applyCorrection = false;
+  simOptions opts;
+
+  static struct option longOpts[] = {
+    {"model", required_argument, 0, 'M'},
+    {"severity", required_argument, 0, 'E'},
+    {"fixed", no_argument, 0, 'F'},
+    {"planes", required_argument, 0, 'P'},
+    {"hugepages", no_argument, 0, 'H'},
+    {"fft-rigor", required_argument, 0, 'R'},
+    {"fft-wisdom", required_argument, 0, 'w'},
+    {"fft-size", required_argument, 0, 'Z'},
+    {"fft-pad", required_argument, 0, 'A'},
+    {"spatial", required_argument, 0, 'G'},
+    {"pyramid-tol", required_argument, 0, 'T'},
+    {"frames", required_argument, 0, 'N'},
+    {"group", required_argument, 0, 'B'},
+    {0, 0, 0, 0}
+  };
 
   while (1) {
 
-    c = getopt(argc, argv, "hvbxcas:l:y:m:t:S:V:d:r:W:D:C:");
+    c = getopt_long(argc, argv, "hvbxcas:l:y:m:t:S:V:d:r:W:D:C:j:", longOpts, NULL);
     if (c == -1)
       break;
 
@@ -66,7 +95,10 @@ int main(int argc, char **argv){
       sScale = atof(optarg);
       break;
     case 'v':
-      verbose = 1;
+      verbose = opts.verbose = 1;
+      break;
+    case 'j':
+      fftThreads = atoi(optarg);
       break;
     case 'b':
       dataType = 'b';
@@ -108,6 +140,76 @@ int main(int argc, char **argv){
     case 'C':
       sscanf(optarg,"%f,%f,%f", &(kernelScale[0]), &(kernelScale[1]), &(kernelScale[2]));
       break;
+    case 'M':
+      if (strcmp(optarg,"brettel")==0 || strcmp(optarg,"vienot")==0 || 
+	  strcmp(optarg,"machado")==0) 
+	opts.model = optarg[0];
+      else std::cerr << "unknown model: " << optarg << " (using brettel)" << std::endl;
+      break;
+    case 'E':
+      if (sscanf(optarg,"%f",&(opts.severity))!=1 || 
+	  opts.severity<0.0 || opts.severity>100.0){
+	std::cerr << "severity must be between 0 and 100 (using 100)" << std::endl;
+	opts.severity = 100.0;
+      }
+      opts.severity /= 100.0;
+      break;
+    case 'F':
+      opts.fixedPoint = 1;
+      break;
+    case 'P':
+      if (strcmp(optarg,"fp16")==0) opts.planes = FLOAT16;
+      else if (strcmp(optarg,"bf16")==0) opts.planes = BFLOAT16;
+      else if (strcmp(optarg,"float")==0) opts.planes = FLOAT32;
+      else std::cerr << "unknown plane storage: " << optarg << " (using float)" << std::endl;
+      break;
+    case 'H':
+      poolSetHugePages(1);
+      break;
+    case 'R':
+      if (strcmp(optarg,"estimate")==0) fftSetRigor(FFTW_ESTIMATE);
+      else if (strcmp(optarg,"measure")==0) fftSetRigor(FFTW_MEASURE);
+      else if (strcmp(optarg,"patient")==0) fftSetRigor(FFTW_PATIENT);
+      else std::cerr << "unknown fft rigor: " << optarg << " (using estimate)" << std::endl;
+      break;
+    case 'w':
+      wisdomFile = optarg;
+      break;
+    case 'Z':
+      if (strcmp(optarg,"smooth")==0) fftSetSizeMode(7, 0);
+      else if (strcmp(optarg,"smooth13")==0) fftSetSizeMode(13, 0);
+      else if (strcmp(optarg,"measure")==0) fftSetSizeMode(13, 1);
+      else std::cerr << "unknown fft size mode: " << optarg << " (using smooth)" << std::endl;
+      break;
+    case 'A':
+      if (strcmp(optarg,"fast")==0 || strcmp(optarg,"exact")==0) opts.pad = optarg[0];
+      else std::cerr << "unknown fft pad: " << optarg << " (using fast)" << std::endl;
+      break;
+    case 'G':
+      if (strcmp(optarg,"fft")==0 || strcmp(optarg,"iir")==0 || strcmp(optarg,"dct")==0 ||
+	  strcmp(optarg,"auto")==0 || strcmp(optarg,"pyramid")==0) 
+	opts.spatial = optarg[0];
+      else std::cerr << "unknown spatial filter: " << optarg << " (using fft)" << std::endl;
+      break;
+    case 'T':
+      sscanf(optarg,"%f",&(opts.pyramidTol));
+      if (opts.pyramidTol<=0.0 || opts.pyramidTol>=1.0){
+	std::cerr << "pyramid tolerance must be between 0 and 1 (using 0.01)" << std::endl;
+	opts.pyramidTol = 1e-2;
+      }
+      break;
+    case 'N':
+      if (sscanf(optarg,"%d%c",&frames,&trailing)!=1 || frames<0){
+	std::cerr << "frames must be a whole number, 0 or more (using 1)" << std::endl;
+	frames = 1;
+      }
+      break;
+    case 'B':
+      if (sscanf(optarg,"%d%c",&group,&trailing)!=1 || group<1){
+	std::cerr << "group must be a whole number, 1 or more (using 1)" << std::endl;
+	group = 1;
+      }
+      break;
     }
 
   }
@@ -125,76 +227,134 @@ int main(int argc, char **argv){
     exit(0);
   }
 
-  int i;
+  if (fftThreads<=0) fftThreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  fftSetThreads(fftThreads);
+
+  // Slow planning only pays with wisdom kept between runs
+  if (wisdomFile==NULL && fftGetRigor()!=FFTW_ESTIMATE) wisdomFile = FFT_WISDOM_FILE;
+  if (wisdomFile && fftLoadWisdom(wisdomFile) && verbose==1)
+    std::cerr << "read fft wisdom from " << wisdomFile << std::endl;
+
+  // The frames (--frames, 0 = as many as there are) are read, simulated 
+  // and written a group (--group) at a time; runSimulation transforms a 
+  // group's frames together where it can.
+  if (frames > 0 && group > frames) group = frames;
   unsigned char *rawData; 
-  rawData = new unsigned char [x*y*bytesPerPix*3];
+  rawData = new unsigned char [(long)x*y*bytesPerPix*3*group];
+
+  if (applyCorrection)
+    std::cerr << "Applying Daltonize: lmStretch=" << lmStretch << 
+      ", lmScale=" << lumScale << ", sScale=" << sScale << std::endl;
+
+  // *** FIX ME: The following is inefficient when we want to get multiple images
+  // out. For example, for daltonize demos, we usually want 3 out images:
+  // the daltonized, the daltonized brettelized, and the original brettelized.
+  // Since they all rely on the smae pre-processing and post-processing, it 
+  // would be much better to return all three (or at least the first two)
+  int i, done = 0, want, got, outOfMemory = 0;
+  long cut = 0;
+  poolStats pool;
+  while (frames==0 || done<frames){
+    want = (frames==0 || frames-done>group) ? group : frames-done;
+    got = readFrames(rawData, x, y, want, dataType, &cut);
+    if (got==0) break;
+
+    startTicks = clock();
+    if(applyCorrection){
+      for (i=0; i<got; i++)
+	runCorrection(rawData + (long)x*y*3*i, x, y, simDisp, viewDisp, 
+		      lmStretch, lumScale, sScale);
+    }
+    opts.frames = got;
+    runSimulation((unsigned char *)rawData, x, y, viewDist, dpi, sensorType, 
+		  simDisp, viewDisp, kernelWt, kernelSD, kernelScale, opts);
+    busyTicks += clock()-startTicks;
+
+    // a failed allocation leaves the frames half done
+    poolGetStats(pool);
+    if (pool.failed){
+      std::cerr << "out of memory; frames " << done+1 << " on are not written" << std::endl;
+      outOfMemory = 1;
+      break;
+    }
+    writeFrames(rawData, x, y, got, dataType);
+    done += got;
+    if (got<want) break;
+  }
+  vischeckSecs = (float)busyTicks/CLOCKS_PER_SEC;
+  if (cut)
+    std::cerr << "input ends part way through frame " << done+1 << " (" << cut << " of " 
+	      << (long)x*y*3 << " bytes); it is left out" << std::endl;
+
+  //fclose(stdout);
+  if(verbose==1){
+    std::cerr << "Vischeck: " << vischeckSecs << "s; " << std::endl;
+    if (done>1)
+      std::cerr << "frames: " << done << ", groups of " << group << ", " 
+		<< (vischeckSecs>0.0 ? done/vischeckSecs : 0.0) << " frames/s" << std::endl;
+    poolPrintStats();
+    fftPrintPlanStats();
+    kernSpecPrintStats();
+  }
+  fftPlanStats planStats;
+  fftGetPlanStats(planStats);
+  if (wisdomFile && planStats.plansMade>0) fftSaveWisdom(wisdomFile);
+  fftForgetPlans();
+  kernSpecForget();
+  delete [] rawData;
+  return (cut || outOfMemory) ? 1 : 0;
+}
+
+
+// Up to frames frames of x by y, as dataType says; returns how many whole
+// ones came. If the input ends part way through a frame, *cut is set to 
+// the bytes of it that did (and it isn't counted).
+int readFrames(unsigned char *data, int x, int y, int frames, char dataType, long *cut)
+{
+  long n = (long)x*y*3, got = 0, i;
+  unsigned int v[3];
 
   switch(dataType){
   case 'b':
-    fread(rawData, bytesPerPix, x*y*3, stdin);
+    got = fread(data, 1, n*frames, stdin);
     break;
   case 'x':
-    for(i=0; i<x*y*3; i++){
-      fscanf(stdin, "%2x", (unsigned int *)&(rawData[i]));
-    }
+    for (got=0; got<n*frames && fscanf(stdin, "%2x", v)==1; got++) data[got] = v[0];
     break;
   case 'c':
-    unsigned char *tmp = rawData;
-    for(i=0; i<x*y; i++){
-      fscanf(stdin, "%x%x%x\n", (unsigned int *)tmp++, (unsigned int *)tmp++, (unsigned int *)tmp++);
-    }
+    for (got=0; got<n*frames && fscanf(stdin, "%x%x%x\n", v, v+1, v+2)==3; got+=3)
+      for (i=0; i<3; i++) data[got+i] = v[i];
     break;
   }
+  *cut = got%n;
+  return (int)(got/n);
+}
 
-  //fclose(stdin);
-  
-  // *** FIX ME: The following is inefficient when we want to get multiple images
-  // out. For example, for daltonize demos, we usually want 3 out images:
-  // the daltonized, the daltonized brettelized, and the original brettelized.
-  // Since they all rely on the smae pre-processing and post-processing, it 
-  // would be much better to return all three (or at least the first two)
-  startTicks = clock();
-  if(applyCorrection){
-    std::cerr << "Applying Daltonize: lmStretch=" << lmStretch << 
-      ", lmScale=" << lumScale << ", sScale=" << sScale << std::endl;
-    runCorrection((unsigned char *)rawData, x, y, simDisp, viewDisp, 
-		  lmStretch, lumScale, sScale);
-  }
-  runSimulation((unsigned char *)rawData, x, y, viewDist, dpi, sensorType, 
-		simDisp, viewDisp, kernelWt, kernelSD, kernelScale);
-  vischeckSecs = (float)(1.0*clock()/CLOCKS_PER_SEC-startTicks/CLOCKS_PER_SEC);
+void writeFrames(const unsigned char *data, int x, int y, int frames, char dataType)
+{
+  long n = (long)x*y*3*frames, i;
 
-  //
-  // Write processed data
-  // 
-  //fid = fopen(outFile, "wb");
   if (stdout==NULL){
     std::cerr << "ERROR: stdout not open!" << std::endl;
     exit(0);
   }
   switch(dataType){
   case 'b':
-    fwrite(rawData, bytesPerPix, x*y*3, stdout);
+    fwrite(data, 1, n, stdout);
     break;
   case 'x':
-    for(i=0; i<x*y*3; i++){
-      fprintf(stdout, "%.2x", rawData[i]);
+    for(i=0; i<n; i++){
+      fprintf(stdout, "%.2x", data[i]);
     }
     break;
   case 'c':
-    unsigned char *tmp = rawData;
-    for(i=0; i<x*y; i++){
-      fprintf(stdout, "%.2x%.2x%.2x\n", *(tmp++), *(tmp++), *(tmp++));
+    for(i=0; i<n; i+=3){
+      fprintf(stdout, "%.2x%.2x%.2x\n", data[i], data[i+1], data[i+2]);
     }
     break;
   }
-  
-  //fclose(stdout);
-  if(verbose==1)		
-    std::cerr << "Vischeck: " << vischeckSecs << "s; " << std::endl;
 }
 
-
 void printHelp(void){
     std::cout << std::endl << "runVischeck [options]" <<std::endl<<std::endl;
     std::cout << "  Takes raw RGB image on STDIN, processes it, and delivers result on STDOUT."<<std::endl<<std::endl;
@@ -214,5 +374,34 @@ void printHelp(void){
     std::cout << "         \t(default = Poirson & Wandell)" <<std::endl;
     std::cout << "  -D:    \t(kernel widths, SDs) lum1,lum2,lum3,l-m1,l-m2,l-m3,s1,s2,s3" <<std::endl;
     std::cout << "         \t(default = Poirson & Wandell)" <<std::endl;
-    std::cout << "  -C:    \t(kernel scale) lum,l-m,s (default = 1,1,1)" <<std::endl<<std::endl;
+    std::cout << "  -C:    \t(kernel scale) lum,l-m,s (default = 1,1,1)" <<std::endl;
+    std::cout << "  -j:    \tthreads for the FFTs; 0 = one per core (default=1)" <<std::endl;
+    std::cout << "  --model:\tdichromat model- brettel, vienot or machado (default=brettel)" <<std::endl;
+    std::cout << "         \t(vienot is a single 3x3 for protans & deutans; faster, less exact)" <<std::endl;
+    std::cout << "  --severity:\tanomalous trichromat severity, 0-100 (default=100, ie. dichromat)" <<std::endl;
+    std::cout << "         \t(below 100 the machado model is used)" <<std::endl;
+    std::cout << "  --fixed:\tinteger arithmetic when there is no spatial filtering" <<std::endl;
+    std::cout << "         \t(faster; the same output, checked for every color by make check)" <<std::endl;
+    std::cout << "  --planes:\timage plane storage for spatial filtering- float, fp16 or bf16" <<std::endl;
+    std::cout << "         \t(default=float; the 16-bit ones halve the plane memory)" <<std::endl;
+    std::cout << "  --spatial:\tspatial filtering- fft (padded FFT convolution), iir" <<std::endl;
+    std::cout << "         \t(recursive Gaussians with mirrored edges), dct (DCT with" <<std::endl;
+    std::cout << "         \tmirrored edges, no pad), auto (the cheapest for each" <<std::endl;
+    std::cout << "         \tchannel) or pyramid (iir, on a smaller copy of each channel" <<std::endl;
+    std::cout << "         \twhose kernel is wide enough; approximate); default=fft" <<std::endl;
+    std::cout << "  --pyramid-tol:\tfor --spatial pyramid, the kernel's response allowed at" <<std::endl;
+    std::cout << "         \tthe smaller copy's Nyquist; smaller is slower and closer (default=0.01)" <<std::endl;
+    std::cout << "  --frames:\tx by y frames on STDIN, back to back; 0 = until the input ends" <<std::endl;
+    std::cout << "         \t(default=1); a frame cut short by the end of the input is an" <<std::endl;
+    std::cout << "         \terror and is not written" <<std::endl;
+    std::cout << "  --group:\tframes simulated together; with FFT spatial filtering their" <<std::endl;
+    std::cout << "         \ttransforms are batched (default=1)" <<std::endl;
+    std::cout << "  --hugepages:\task for huge pages on the big image and FFT buffers" <<std::endl;
+    std::cout << "  --fft-size:\tpadded FFT sizes- smooth (factors 2,3,5,7), smooth13 (up to 13)" <<std::endl;
+    std::cout << "         \tor measure (the fastest 13-smooth size nearby; default=smooth)" <<std::endl;
+    std::cout << "  --fft-pad:\tFFT pad from the kernels' reach- fast (all but 1% of their weight)" <<std::endl;
+    std::cout << "         \tor exact (all but 1e-5, as the mirrored edges of --spatial iir; default=fast)" <<std::endl;
+    std::cout << "  --fft-rigor:\tFFTW planner- estimate, measure or patient (default=estimate)" <<std::endl;
+    std::cout << "  --fft-wisdom:\tFFTW wisdom file, read at start and updated at exit" <<std::endl;
+    std::cout << "         \t(default=" << FFT_WISDOM_FILE << " if the rigor isn't estimate, else none)" <<std::endl<<std::endl;
 }
@@ -0,0 +1,446 @@
+#include "pipeline.h"
+#include "colorTools.h"
+#include <stdlib.h>
+#include <math.h>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+// Per-pixel versions of the img stages. They do the same arithmetic in the
+// same order as the plane-at-a-time versions in imglib.cxx.
+
+static inline void loadPixel(const float *T, const unsigned char *px, float v[3])
+{
+  // see img::assignUcharLinear
+  int R = px[0], G = px[1]+256, B = px[2]+512;
+  v[0] = T[R     ] + T[G     ] + T[B     ];
+  v[1] = T[R+ 768] + T[G+ 768] + T[B+ 768];
+  v[2] = T[R+1536] + T[G+1536] + T[B+1536];
+}
+
+static inline void xformPixel(float v[3], const float *tm)
+{
+  float a = v[0], b = v[1], c = v[2];
+  v[0] = a*tm[0] + b*tm[1] + c*tm[2];
+  v[1] = a*tm[3] + b*tm[4] + c*tm[5];
+  v[2] = a*tm[6] + b*tm[7] + c*tm[8];
+}
+
+template<class Observer> static inline void brettelPixel(float v[3], const float *bp)
+{
+  // see brettelPlane; bp = {inflectionVal, k1x, k1y, k2x, k2y}
+  if (!Observer::brettel) return;
+  float x = v[Observer::X], y = v[Observer::Y];
+  float side = (y - bp[0]*x) * x;
+  float p1 = bp[1]*x + bp[2]*y;
+  float p2 = bp[3]*x + bp[4]*y;
+  v[Observer::OUT] = side < 0.0f ? p1 : p2;
+}
+
+// The tables already deliver RGB, or OPP, when that is the working space
+template<class Space> static inline void toRGBPixel(float v[3], const float *tm)
+{
+  if (Space::label != RGB) xformPixel(v, tm);
+}
+
+template<class Space> static inline void toOppPixel(float v[3], const float *tm)
+{
+  if (Space::label != OPP) xformPixel(v, tm);
+}
+
+// The inverse gamma sample a (linear) value goes to: clipValRange, then
+// lookupPlane's rounding
+static inline int outIndex(float v, float maxImgVal, float maxIdx)
+{
+  v = v < maxImgVal ? (v > 0.0f ? v : 0.0f) : maxImgVal;
+  v = v + 0.5f;
+  v = v < maxIdx ? v : maxIdx;
+  return (int)v;
+}
+
+void pipelineParams::buildOutTables()
+{
+  // lookupPlane + the clip and rounding of interleaveRGB, for each sample
+  int c, i;
+  delete [] outTables;
+  outTables = new unsigned char[3*gammaLen];
+  for (c=0; c<3; c++)
+    for (i=0; i<gammaLen; i++){
+      float g = invGamma[c][i];
+      g = g > 0.0f ? g : 0.0f;
+      g = g < 255.0f ? g : 255.0f;
+      outTables[c*gammaLen+i] = (unsigned char)(g + .5f);
+    }
+}
+
+// One pixel of simPipeline::run (in may equal out)
+template<class Space, class Observer>
+static inline void runPixel(const unsigned char *in, unsigned char *out, const pipelineParams &p)
+{
+  const unsigned char *oR = p.outTables, *oG = oR+p.gammaLen, *oB = oG+p.gammaLen;
+  const float maxIdx = (float)(p.gammaLen-1);
+  float v[3];
+
+  loadPixel(p.inTables, in, v);
+  brettelPixel<Observer>(v, p.brettel);
+  toRGBPixel<Space>(v, p.toRGB);
+  out[0] = oR[outIndex(v[0], p.maxImgVal, maxIdx)];
+  out[1] = oG[outIndex(v[1], p.maxImgVal, maxIdx)];
+  out[2] = oB[outIndex(v[2], p.maxImgVal, maxIdx)];
+}
+
+// runFixed's way out, kept out of its loop
+template<class Space, class Observer>
+static void __attribute__((noinline)) redoPixel(const unsigned char *in, unsigned char *out,
+						const pipelineParams &p)
+{
+  runPixel<Space, Observer>(in, out, p);
+}
+
+template<class Space, class Observer>
+void simPipeline<Space, Observer, false>::run(const unsigned char *in, unsigned char *out,
+					      int npix, const pipelineParams &p)
+{
+  int i;
+
+  for (i=0; i<npix; i++) runPixel<Space, Observer>(in+3*i, out+3*i, p);
+}
+
+static void mult3x3(const double a[9], const double b[9], double out[9])
+{
+  int i, j;
+  for (i=0; i<3; i++)
+    for (j=0; j<3; j++)
+      out[i*3+j] = a[i*3]*b[j] + a[i*3+1]*b[3+j] + a[i*3+2]*b[6+j];
+}
+
+static double peakSum(const int *T)
+{
+  // largest |T[R] + T[G+256] + T[B+512]| could be, for one row of tables
+  double sum = 0.0;
+  int c, v, peak;
+  for (c=0; c<3; c++){
+    peak = 0;
+    for (v=0; v<256; v++) if (abs(T[c*256+v]) > peak) peak = abs(T[c*256+v]);
+    sum += peak;
+  }
+  return sum;
+}
+
+template<class Space, class Observer>
+int simPipeline<Space, Observer, false>::buildFixed(fixedTables &ft, displayDevice &disp,
+						    const float inXform[9], float scale,
+						    const pipelineParams &p)
+{
+  // rgb[s] = toRGB * proj[s] * inXform, where proj[s] is the Brettel 
+  // projection on half-plane s (set 0 is where brettelPlane takes p1), 
+  // then side = rows X and Y - inflectionVal*X of inXform.
+  double in[9], toRGB[9], proj[9], t[9], m[9], side[6];
+  int s, i, c, v, idx, bits;
+  int nSets = Observer::brettel ? 2 : 1;
+
+  if (p.maxImgVal > 255.0) return 0;
+  ft.sideMargin = 0;
+  for (i=0; i<9; i++){
+    in[i] = inXform[i];
+    toRGB[i] = (Space::label==RGB) ? (i%4==0) : p.toRGB[i];
+  }
+  for (s=0; s<nSets; s++){
+    for (i=0; i<9; i++) proj[i] = (i%4==0);
+    if (Observer::brettel){
+      proj[Observer::OUT*4] = 0.0;
+      proj[Observer::OUT*3+Observer::X] = p.brettel[1+2*s];
+      proj[Observer::OUT*3+Observer::Y] = p.brettel[2+2*s];
+    }
+    mult3x3(proj, in, t);
+    mult3x3(toRGB, t, m);
+    disp.getInputTablesFixed(m, 3, scale, FIXED_BITS, ft.rgb+s*9*256);
+  }
+  // The sums (and the rounding offset) must stay well inside an int
+  for (s=0; s<nSets*3; s++)
+    if (peakSum(ft.rgb+s*3*256) > (double)(1<<30)) return 0;
+
+  if (Observer::brettel){
+    // Only the signs of the side rows matter, so they get all the 
+    // fractional bits that fit (dark colors need them).
+    for (i=0; i<3; i++){
+      side[i] = in[Observer::X*3+i];
+      side[3+i] = in[Observer::Y*3+i] - p.brettel[0]*in[Observer::X*3+i];
+    }
+    disp.getInputTablesFixed(side, 2, scale, FIXED_BITS, ft.side);
+    double peak = peakSum(ft.side) > peakSum(ft.side+768) ? peakSum(ft.side) : peakSum(ft.side+768);
+    if (peak > (double)(1<<30)) return 0;
+    for (bits=FIXED_BITS; bits<30 && peak*2.0 <= (double)(1<<30); bits++) peak *= 2.0;
+    disp.getInputTablesFixed(side, 2, scale, bits, ft.side);
+    // float's x and d are good to a few of their ulps, so closer than
+    // this to 0 either side could be taken
+    ft.sideMargin = (int)(peak*FIXED_SIDE_MARGIN) + 2;
+  }
+
+  // clipValRange + lookupPlane + interleaveRGB, for each rounded value
+  for (c=0; c<3; c++)
+    for (v=0; v<256; v++){
+      idx = v < p.gammaLen-1 ? v : p.gammaLen-1;
+      float g = p.invGamma[c][idx];
+      g = g > 0.0f ? g : 0.0f;
+      g = g < 255.0f ? g : 255.0f;
+      ft.out[c*256+v] = (int)(g + .5f);
+    }
+  ft.maxVal = (int)floor(p.maxImgVal*(1<<FIXED_BITS) + 0.5);
+  return 1;
+}
+
+template<class Space, class Observer>
+void simPipeline<Space, Observer, false>::runFixed(const unsigned char *in, unsigned char *out,
+						  int npix, const fixedTables &ft, 
+						  const pipelineParams &p)
+{
+  // The Brettel side test is brettelPlane's (y - inflectionVal*x)*x < 0,
+  // ie. x and d = y - inflectionVal*x nonzero and of opposite sign.
+  // A pixel with x or d within sideMargin of 0, or a value within 
+  // FIXED_TIE_MARGIN of rounding the other way, is done again by run's
+  // float arithmetic, so the output is run's.
+  const int *S = ft.side;
+  const int half = 1<<(FIXED_BITS-1);
+  const int tie = FIXED_TIE_MARGIN, lowBits = (1<<FIXED_BITS)-1;
+  const int sideMargin = ft.sideMargin;
+  const unsigned sideSpan = 2*sideMargin-1;
+  int i = 0;
+
+#ifdef __AVX2__
+  // 8 pixels at a time. Each pixel's RGB is gathered as one 32-bit word, 
+  // so the last pixel (whose word would run past the end) is left to the 
+  // scalar loop.
+  const __m256i offs = _mm256_setr_epi32(0, 3, 6, 9, 12, 15, 18, 21);
+  const __m256i mask = _mm256_set1_epi32(0xff);
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i vmax = _mm256_set1_epi32(ft.maxVal);
+  const __m256i vhalf = _mm256_set1_epi32(half);
+  const __m256i set1 = _mm256_set1_epi32(9*256);
+  const __m256i vside = _mm256_set1_epi32(ft.sideMargin);
+  const __m256i vtie = _mm256_set1_epi32(tie), vlow = _mm256_set1_epi32(lowBits);
+  const __m256i vtie2 = _mm256_set1_epi32(2*tie);
+  int o[3][8] __attribute__((aligned(32)));
+  for (; i+8<npix; i+=8){
+    __m256i w = _mm256_i32gather_epi32((const int *)(in+3*i), offs, 1);
+    __m256i R = _mm256_and_si256(w, mask);
+    __m256i G = _mm256_add_epi32(_mm256_and_si256(_mm256_srli_epi32(w, 8), mask), 
+				 _mm256_set1_epi32(256));
+    __m256i B = _mm256_add_epi32(_mm256_and_si256(_mm256_srli_epi32(w, 16), mask),
+				 _mm256_set1_epi32(512));
+    __m256i redo = zero;
+    if (Observer::brettel){
+      __m256i x = _mm256_add_epi32(_mm256_add_epi32(_mm256_i32gather_epi32(S, R, 4),
+						    _mm256_i32gather_epi32(S, G, 4)),
+				   _mm256_i32gather_epi32(S, B, 4));
+      __m256i d = _mm256_add_epi32(_mm256_add_epi32(_mm256_i32gather_epi32(S+768, R, 4),
+						    _mm256_i32gather_epi32(S+768, G, 4)),
+				   _mm256_i32gather_epi32(S+768, B, 4));
+      __m256i opp = _mm256_srai_epi32(_mm256_xor_si256(x, d), 31);
+      __m256i anyZero = _mm256_or_si256(_mm256_cmpeq_epi32(x, zero), _mm256_cmpeq_epi32(d, zero));
+      __m256i first = _mm256_andnot_si256(anyZero, opp);
+      redo = _mm256_or_si256(_mm256_cmpgt_epi32(vside, _mm256_abs_epi32(x)),
+			     _mm256_cmpgt_epi32(vside, _mm256_abs_epi32(d)));
+      __m256i base = _mm256_andnot_si256(first, set1);
+      R = _mm256_add_epi32(R, base);
+      G = _mm256_add_epi32(G, base);
+      B = _mm256_add_epi32(B, base);
+    }
+    for (int c=0; c<3; c++){
+      const int *T = ft.rgb+c*768;
+      __m256i v = _mm256_add_epi32(_mm256_add_epi32(_mm256_i32gather_epi32(T, R, 4),
+						    _mm256_i32gather_epi32(T, G, 4)),
+				   _mm256_i32gather_epi32(T, B, 4));
+      v = _mm256_add_epi32(_mm256_min_epi32(_mm256_max_epi32(v, zero), vmax), vhalf);
+      __m256i f = _mm256_and_si256(_mm256_add_epi32(v, vtie), vlow);
+      redo = _mm256_or_si256(redo, _mm256_cmpgt_epi32(vtie2, f));
+      v = _mm256_srai_epi32(v, FIXED_BITS);
+      _mm256_store_si256((__m256i *)o[c], _mm256_i32gather_epi32(ft.out+c*256, v, 4));
+    }
+    int redoMask = _mm256_movemask_ps(_mm256_castsi256_ps(redo));
+    for (int k=0; k<8; k++){
+      if (redoMask & (1<<k)){
+	redoPixel<Space, Observer>(in+3*(i+k), out+3*(i+k), p);
+	continue;
+      }
+      out[3*(i+k)  ] = o[0][k];
+      out[3*(i+k)+1] = o[1][k];
+      out[3*(i+k)+2] = o[2][k];
+    }
+  }
+#endif
+
+  // The rest a block at a time, as store does: the sums (and the side 
+  // test), then the clip, rounding and tie test for the whole block (this
+  // loop vectorizes), then the byte look-ups.
+  int v[3][FIXED_BLOCK], redo[FIXED_BLOCK], n, k, c;
+  for (; i<npix; i+=n){
+    n = npix-i < FIXED_BLOCK ? npix-i : FIXED_BLOCK;
+    const unsigned char *px = in+3*i;
+    for (k=0; k<n; k++){
+      int R = px[3*k], G = px[3*k+1]+256, B = px[3*k+2]+512;
+      const int *T = ft.rgb;
+      redo[k] = 0;
+      if (Observer::brettel){
+	// (a 0 is within sideMargin, so is redone anyway)
+	int x = S[R] + S[G] + S[B];
+	int d = S[R+768] + S[G+768] + S[B+768];
+	if ((x^d) >= 0) T += 9*256;
+	redo[k] = ((unsigned)(x + sideMargin-1) < sideSpan) | 
+	  ((unsigned)(d + sideMargin-1) < sideSpan);
+      }
+      v[0][k] = T[R    ] + T[G    ] + T[B    ];
+      v[1][k] = T[R+768] + T[G+768] + T[B+768];
+      v[2][k] = T[R+1536] + T[G+1536] + T[B+1536];
+    }
+    for (c=0; c<3; c++)
+      for (k=0; k<n; k++){
+	int t = (v[c][k] < ft.maxVal ? (v[c][k] > 0 ? v[c][k] : 0) : ft.maxVal) + half;
+	redo[k] |= (unsigned)((t + tie) & lowBits) < 2u*tie;
+	v[c][k] = c*256 + (t >> FIXED_BITS);
+      }
+    for (k=0; k<n; k++){
+      if (redo[k]) redoPixel<Space, Observer>(px+3*k, out+3*(i+k), p);
+      else{
+	out[3*(i+k)  ] = ft.out[v[0][k]];
+	out[3*(i+k)+1] = ft.out[v[1][k]];
+	out[3*(i+k)+2] = ft.out[v[2][k]];
+      }
+    }
+  }
+}
+
+// Where pixel b is in the float planes, and in n how many from there are 
+// side by side (up to TRANSFORM_BLOCK): planes staged in the FFT buffer 
+// (img::stageInFFT) go a row at a time
+static inline long planeSpan(img &image, int b, int &n)
+{
+  int npix = image.getNpix(), r = image.getRows(), pitch = image.getPitch(), x;
+  n = npix-b < TRANSFORM_BLOCK ? npix-b : TRANSFORM_BLOCK;
+  if (pitch==r) return b;
+  x = b % r;
+  if (n > r-x) n = r-x;
+  return (long)(b/r)*pitch + x;
+}
+
+template<class Space, class Observer>
+void simPipeline<Space, Observer, true>::load(img &image, const unsigned char *in,
+					      const pipelineParams &p)
+{
+  // With 16-bit planes each block goes through float scratch on the stack
+  // and is narrowed as a whole, so the per-pixel loop stays the same.
+  const float *T = p.inTables;
+  const int narrow = (image.planeStorage!=FLOAT32);
+  float rbuf[TRANSFORM_BLOCK], gbuf[TRANSFORM_BLOCK], bbuf[TRANSFORM_BLOCK];
+  int b, n, i, npix = image.npix;
+  long o;
+
+  for (b=0; b<npix; b+=n){
+    o = planeSpan(image, b, n);
+    float * __restrict rtmp = narrow ? rbuf : image.red+o;
+    float * __restrict gtmp = narrow ? gbuf : image.green+o;
+    float * __restrict btmp = narrow ? bbuf : image.blue+o;
+    const unsigned char *px = in+3*b;
+    for (i=0; i<n; i++){
+      float v[3];
+      loadPixel(T, px+3*i, v);
+      brettelPixel<Observer>(v, p.brettel);
+      toOppPixel<Space>(v, p.toOpp);
+      rtmp[i] = v[0];
+      gtmp[i] = v[1];
+      btmp[i] = v[2];
+    }
+    if (narrow){
+      packPlane(rbuf, image.red16+b, n, image.planeStorage);
+      packPlane(gbuf, image.green16+b, n, image.planeStorage);
+      packPlane(bbuf, image.blue16+b, n, image.planeStorage);
+    }
+  }
+  image.hasPendingXform = 0;
+  image.colorSpaceLabel = OPP;
+}
+
+template<class Space, class Observer>
+void simPipeline<Space, Observer, true>::store(img &image, unsigned char *out,
+					       const pipelineParams &p)
+{
+  // the planes are in OPP whatever Space was
+  const unsigned char *oR = p.outTables, *oG = oR+p.gammaLen, *oB = oG+p.gammaLen;
+  const float maxIdx = (float)(p.gammaLen-1);
+  const float maxImgVal = p.maxImgVal;
+  const int narrow = (image.planeStorage!=FLOAT32);
+  float rbuf[TRANSFORM_BLOCK], gbuf[TRANSFORM_BLOCK], bbuf[TRANSFORM_BLOCK];
+  int ri[TRANSFORM_BLOCK], gi[TRANSFORM_BLOCK], bi[TRANSFORM_BLOCK];
+  const float *M = p.toRGB;
+  int b, n, i, npix = image.npix;
+  long o;
+
+  if (!narrow) image.flushTransforms();
+  for (b=0; b<npix; b+=n){
+    o = planeSpan(image, b, n);
+    if (narrow){
+      unpackPlane(image.red16+b, rbuf, n, image.planeStorage);
+      unpackPlane(image.green16+b, gbuf, n, image.planeStorage);
+      unpackPlane(image.blue16+b, bbuf, n, image.planeStorage);
+    }
+    const float * __restrict rtmp = narrow ? rbuf : image.red+o;
+    const float * __restrict gtmp = narrow ? gbuf : image.green+o;
+    const float * __restrict btmp = narrow ? bbuf : image.blue+o;
+    // toRGBPixel<oppSpace> and the clip for the whole block (this loop 
+    // vectorizes), then the table reads
+    for (i=0; i<n; i++){
+      float v[3] = {rtmp[i], gtmp[i], btmp[i]};
+      xformPixel(v, M);
+      ri[i] = outIndex(v[0], maxImgVal, maxIdx);
+      gi[i] = outIndex(v[1], maxImgVal, maxIdx);
+      bi[i] = outIndex(v[2], maxImgVal, maxIdx);
+    }
+    unsigned char *px = out+3*b;
+    for (i=0; i<n; i++){
+      px[3*i  ] = oR[ri[i]];
+      px[3*i+1] = oG[gi[i]];
+      px[3*i+2] = oB[bi[i]];
+    }
+  }
+  image.colorSpaceLabel = RGB;
+}
+
+// The instantiated configurations. Observers are in the order n, p, d, t.
+#define PLAIN(S, O)   { simPipeline<S, O, false>::run, NULL, NULL, \
+			simPipeline<S, O, false>::buildFixed, simPipeline<S, O, false>::runFixed }
+#define SPATIAL(S, O) { NULL, simPipeline<S, O, true>::load, \
+			simPipeline<oppSpace, normalObserver, true>::store, NULL, NULL }
+
+static const pipelineFns plainPipelines[] = {
+  PLAIN(rgbSpace, normalObserver),
+  PLAIN(lmsSpace, normalObserver),
+  PLAIN(lmsSpace, protanObserver),
+  PLAIN(lmsSpace, deutanObserver),
+  PLAIN(lmsSpace, tritanObserver)
+};
+
+static const pipelineFns spatialPipelines[] = {
+  SPATIAL(oppSpace, normalObserver),
+  SPATIAL(lmsSpace, normalObserver),
+  SPATIAL(lmsSpace, protanObserver),
+  SPATIAL(lmsSpace, deutanObserver),
+  SPATIAL(lmsSpace, tritanObserver)
+};
+
+const pipelineFns *selectPipeline(colorSpaceLabelType space, char observer, int spatial)
+{
+  const pipelineFns *fns = spatial ? spatialPipelines : plainPipelines;
+  int obs;
+
+  switch (observer){
+  case 'n': obs = 0; break;
+  case 'p': obs = 1; break;
+  case 'd': obs = 2; break;
+  case 't': obs = 3; break;
+  default: return NULL;
+  }
+  // Brettel works in LMS; the normal observer may start in any space
+  if (space==LMS) return fns+1+obs;
+  if (obs==0 && space==(spatial ? OPP : RGB)) return fns;
+  return NULL;
+}
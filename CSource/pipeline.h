@@ -0,0 +1,136 @@
+#ifndef __pipeline_h
+#define __pipeline_h
+
+/*
+ *    Compile-time specialized simulation pipelines.
+ *
+ *    runSimulation steers the general img pipeline at run time (color-space
+ *    labels, sensorType tests, the switch in brettelTransform), one member
+ *    call and one trip through memory per stage. For the common cases the
+ *    whole chain is known once the request is parsed, so simPipeline has
+ *    the working color space, the observer and spatial filtering as
+ *    template parameters and does each stage per pixel in one inlined loop:
+ *
+ *      no spatial filtering: bytes -> input tables -> Brettel -> toRGB ->
+ *                            clip -> inverse gamma -> bytes
+ *      spatial filtering:    load:  bytes -> input tables -> Brettel ->
+ *                                   toOpp -> img planes (OPP)
+ *                            (FFT filtering, as before)
+ *                            store: img planes -> toRGB -> clip ->
+ *                                   inverse gamma -> bytes
+ *
+ *    The clip, inverse gamma and rounding to a byte only depend on which
+ *    inverse gamma sample a value rounds to, so they are one byte table
+ *    per channel (pipelineParams::buildOutTables). store reads the planes
+ *    where they are, in the FFT buffer if they were staged there
+ *    (img::stageInFFT), and goes a block at a time: the matrix and the
+ *    table indices for the whole block, then the table reads.
+ *
+ *    load and store also take 16-bit planes (img::setPlaneStorage); the
+ *    values are widened to float a block at a time.
+ *
+ *    Without spatial filtering there is also a fixed-point version
+ *    (buildFixed/runFixed) for 8-bit data. Brettel's projection is linear
+ *    on each side of its split, so the whole chain up to the clip folds into
+ *    two sets of integer input tables (plus two rows for the side test),
+ *    and a pixel costs only table reads, adds, a select, the clip and a 
+ *    byte look-up. Its output is run's, byte for byte: the few pixels 
+ *    where the fixed-point values are too close to a rounding boundary 
+ *    (or to Brettel's split) to be sure which way float goes are done 
+ *    again in float. Near black one step of the inverse gamma table is 
+ *    worth many output levels, so anything less would be off by up to 
+ *    18 there. checkFixed (make check) tries every 8-bit color.
+ *
+ *    The instantiations live in pipeline.cxx; selectPipeline picks one (or
+ *    returns NULL, in which case use the general img pipeline).
+ */
+
+#include "imglib.h"
+
+class displayDevice;
+
+// Color-space tags: the space the input tables deliver.
+struct rgbSpace { static const colorSpaceLabelType label = RGB; };
+struct lmsSpace { static const colorSpaceLabelType label = LMS; };
+struct oppSpace { static const colorSpaceLabelType label = OPP; };
+
+// Observer tags: the cone planes that the Brettel projection reads (X, Y)
+// and rebuilds (OUT); see img::brettelTransform.
+struct normalObserver { static const bool brettel = false; enum {X=0, Y=0, OUT=0}; };
+struct protanObserver { static const bool brettel = true;  enum {X=1, Y=2, OUT=0}; };
+struct deutanObserver { static const bool brettel = true;  enum {X=0, Y=2, OUT=1}; };
+struct tritanObserver { static const bool brettel = true;  enum {X=0, Y=1, OUT=2}; };
+
+// Everything the per-pixel stages need; filled in once per request.
+struct pipelineParams {
+  const float *inTables;	// 9 input tables (displayDevice::getInputTables)
+  float brettel[5];		// img::brettelParams, if the observer needs it
+  float toOpp[9];		// working space -> OPP (spatial filtering only)
+  float toRGB[9];		// working space (OPP if spatial) -> view display RGB
+  const float *invGamma[3];	// view display inverse gamma tables
+  int gammaLen;
+  float maxImgVal;
+  // invGamma clipped to 0-255 and rounded, 3 x gammaLen (buildOutTables)
+  unsigned char *outTables;
+
+  pipelineParams() : outTables(NULL) {}
+  ~pipelineParams() {delete [] outTables;}
+  // owns outTables: not copyable (see img)
+  pipelineParams(const pipelineParams &) = delete;
+  pipelineParams &operator=(const pipelineParams &) = delete;
+  // once invGamma and gammaLen are set
+  void buildOutTables();
+};
+
+// fractional bits of the fixed-point pipeline
+#define FIXED_BITS 16
+// runFixed redoes a value this close (in units of 2^-FIXED_BITS) to 
+// rounding the other way in float
+#define FIXED_TIE_MARGIN 64
+// and a side test this close to 0, as a share of its peak
+#define FIXED_SIDE_MARGIN 1.0e-5
+// pixels per block of runFixed
+#define FIXED_BLOCK 256
+
+// Tables for the fixed-point pipeline (simPipeline::buildFixed). Q16, except
+// side, which gets as many fractional bits as fit.
+struct fixedTables {
+  int rgb[2*9*256];	// view display linear RGB, one set per Brettel half-plane
+  int side[6*256];	// x, and y - inflectionVal*x, for the Brettel side test
+  int out[3*256];	// rounded linear value -> output byte (inverse gamma)
+  int maxVal;		// maxImgVal
+  int sideMargin;	// side values closer to 0 than this are redone in float
+};
+
+template<class Space, class Observer, bool Spatial> struct simPipeline;
+
+template<class Space, class Observer> struct simPipeline<Space, Observer, false> {
+  // in may equal out
+  static void run(const unsigned char *in, unsigned char *out, int npix,
+		  const pipelineParams &p);
+  // returns 0 if the transforms don't fit in fixed point (use run instead)
+  static int buildFixed(fixedTables &ft, displayDevice &disp, const float inXform[9],
+			float scale, const pipelineParams &p);
+  // the same output as run (in may equal out)
+  static void runFixed(const unsigned char *in, unsigned char *out, int npix,
+		       const fixedTables &ft, const pipelineParams &p);
+};
+
+template<class Space, class Observer> struct simPipeline<Space, Observer, true> {
+  static void load(img &image, const unsigned char *in, const pipelineParams &p);
+  static void store(img &image, unsigned char *out, const pipelineParams &p);
+};
+
+struct pipelineFns {
+  void (*run)(const unsigned char *in, unsigned char *out, int npix, const pipelineParams &p);
+  void (*load)(img &image, const unsigned char *in, const pipelineParams &p);
+  void (*store)(img &image, unsigned char *out, const pipelineParams &p);
+  int (*buildFixed)(fixedTables &ft, displayDevice &disp, const float inXform[9],
+		    float scale, const pipelineParams &p);
+  void (*runFixed)(const unsigned char *in, unsigned char *out, int npix, 
+		   const fixedTables &ft, const pipelineParams &p);
+};
+
+const pipelineFns *selectPipeline(colorSpaceLabelType space, char observer, int spatial);
+
+#endif // __pipeline_h
@@ -0,0 +1,173 @@
+#include "pyramid.h"
+#include "bufpool.h"
+#include <math.h>
+
+static const double PI = 3.141592653590;
+
+double pyramidSD(double sd, int level)
+{
+  // reduce and expand each add PYRAMID_LEVEL_VAR*4^k (full-resolution
+  // samples) going between levels k and k+1
+  double s = ldexp(1.0, -2*level);
+  double v = sd*sd*s - 2.0*PYRAMID_LEVEL_VAR*(1.0-s)/3.0;
+  return (v > 0.0) ? sqrt(v) : 0.0;
+}
+
+int pyramidLevel(const gaussSum &k, int width, int height, double tol)
+{
+  // exp(-(pi*sd)^2/2) is a Gaussian's response at Nyquist
+  double minSD = sqrt(-2.0*log(tol))/PI, sd;
+  int level = 0, i;
+
+  if (k.n==0) return 0;
+  for (sd=k.sd[0], i=1; i<k.n; i++)
+    if (k.sd[i] < sd) sd = k.sd[i];
+  while (level < PYRAMID_MAX_LEVELS){
+    width = (width+1)/2;
+    height = (height+1)/2;
+    if (width < PYRAMID_MIN_SIZE || height < PYRAMID_MIN_SIZE) break;
+    if (pyramidSD(sd, level+1) < minSD) break;
+    level++;
+  }
+  return level;
+}
+
+// Share of k's weight past s on one side
+static double tailShare(const gaussSum &k, double s)
+{
+  double tail = 0.0, total = 0.0;
+  int i;
+
+  for (i=0; i<k.n; i++){
+    total += fabs(k.weight[i]);
+    tail += 0.5*fabs(k.weight[i])*erfc(s/(1.414213562373*k.sd[i]));
+  }
+  return (total > 0.0) ? tail/total : 0.0;
+}
+
+int pyramidPad(const gaussSum &k, int n)
+{
+  int unit = 1<<k.level, lo = 0, hi = n, mid, m;
+
+  if (n % unit==0) return n;
+  // out to where no more than PYRAMID_PAD_TAIL of the kernel is left
+  while (lo < hi){
+    mid = (lo+hi)/2;
+    if (tailShare(k, mid) > PYRAMID_PAD_TAIL) lo = mid+1;
+    else hi = mid;
+  }
+  // then on to a multiple of 2^level, but no further than the line's
+  // mirror image (padIndex)
+  m = (n + lo + unit-1) & ~(unit-1);
+  if (m > 2*n) m = (2*n) & ~(unit-1);
+  return m;
+}
+
+// Sample i of a line of n mirrored out to m (n <= m <= 2n), and that
+// mirrored in turn at its ends
+static inline int padIndex(int i, int n, int m)
+{
+  i = mirrorIndex(i, m);
+  return (i < n) ? i : 2*n-1-i;
+}
+
+// Sample j of the next level down a line of n padded to m
+static inline float reduceAt(const float *t, int j, int n, int m)
+{
+  return 0.125f*(t[padIndex(2*j-1, n, m)] + t[padIndex(2*j+2, n, m)]) +
+    0.375f*(t[padIndex(2*j, n, m)] + t[padIndex(2*j+1, n, m)]);
+}
+
+// in (w x h, pitch apart), padded to W x H (both even; see padIndex), 
+// halved each way into out; tmp holds w*H/2
+static void reduce(const float *in, int w, int h, long pitch, int W, int H, 
+		   float *out, float *tmp)
+{
+  int w2 = W/2, h2 = H/2, i, j;
+
+  // down the columns, a row at a time
+  for (i=0; i<h2; i++){
+    const float *a = in + padIndex(2*i-1, h, H)*pitch, *b = in + padIndex(2*i, h, H)*pitch;
+    const float *c = in + padIndex(2*i+1, h, H)*pitch, *d = in + padIndex(2*i+2, h, H)*pitch;
+    float *t = tmp + (long)i*w;
+    for (j=0; j<w; j++) t[j] = 0.125f*(a[j]+d[j]) + 0.375f*(b[j]+c[j]);
+  }
+  // then along the lines
+  for (i=0; i<h2; i++){
+    const float *t = tmp + (long)i*w;
+    float *o = out + (long)i*w2;
+    o[0] = reduceAt(t, 0, w, W);
+    for (j=1; 2*j+2<w; j++) o[j] = 0.125f*(t[2*j-1]+t[2*j+2]) + 0.375f*(t[2*j]+t[2*j+1]);
+    for (; j<w2; j++) o[j] = reduceAt(t, j, w, W);
+  }
+}
+
+// in (w2 x h2) expanded to out (w x h, pitch apart), dropping any pad
+// past w or h; tmp holds w2*h. Each new sample is 3/4 of the nearer old
+// one and 1/4 of the next.
+static void expand(const float *in, int w2, int h2, float *out, int w, int h, long pitch,
+		   float *tmp)
+{
+  int i, j;
+
+  for (i=0; i<h; i++){
+    int near = i/2, far = mirrorIndex((i & 1) ? near+1 : near-1, h2);
+    const float *a = in + (long)near*w2, *b = in + (long)far*w2;
+    float *t = tmp + (long)i*w2;
+    for (j=0; j<w2; j++) t[j] = 0.75f*a[j] + 0.25f*b[j];
+  }
+  for (i=0; i<h; i++){
+    const float *t = tmp + (long)i*w2;
+    float *o = out + (long)i*pitch;
+    for (j=0; 2*j<w; j++){
+      float lo = t[(j > 0) ? j-1 : 0], hi = t[(j+1 < w2) ? j+1 : w2-1];
+      o[2*j] = 0.75f*t[j] + 0.25f*lo;
+      if (2*j+1 < w) o[2*j+1] = 0.75f*t[j] + 0.25f*hi;
+    }
+  }
+}
+
+void pyramidBlurPlane(float *plane, int width, int height, long pitch, const gaussSum &k)
+{
+  int depth = k.level, L, i;
+  int w[PYRAMID_MAX_LEVELS+1], h[PYRAMID_MAX_LEVELS+1];
+  float *lev[PYRAMID_MAX_LEVELS+1];
+  long p[PYRAMID_MAX_LEVELS+1], total = 0, scratch;
+  gaussSum coarse = k;
+
+  if (depth==0){
+    gaussBlurPlane(plane, width, height, pitch, k);
+    return;
+  }
+  // full resolution padded so that every level halves evenly
+  w[0] = width; h[0] = height;
+  w[depth] = pyramidPad(k, width) >> depth;
+  h[depth] = pyramidPad(k, height) >> depth;
+  for (L=1; L<=depth; L++){
+    w[L] = w[depth] << (depth-L);
+    h[L] = h[depth] << (depth-L);
+    total += (long)w[L]*h[L];
+  }
+  // the biggest of reduce's and expand's scratch is between 0 and 1
+  scratch = (long)w[0]*h[1];
+  if ((long)w[1]*h[0] > scratch) scratch = (long)w[1]*h[0];
+  float *buf = poolAllocFloat(total+scratch), *tmp = buf+total;
+
+  lev[0] = plane;
+  p[0] = pitch;
+  for (L=1; L<=depth; L++){
+    lev[L] = (L==1) ? buf : lev[L-1] + (long)w[L-1]*h[L-1];
+    p[L] = w[L];
+    reduce(lev[L-1], w[L-1], h[L-1], p[L-1], 2*w[L], 2*h[L], lev[L], tmp);
+  }
+
+  // the kernel, less what the way down and back up add
+  for (i=0; i<coarse.n; i++){
+    coarse.sd[i] = pyramidSD(k.sd[i], depth);
+    coarse.how[i] = (coarse.sd[i] < IIR_MIN_SD) ? TERM_DIRECT : TERM_RECURSIVE;
+  }
+  gaussBlurPlane(lev[depth], w[depth], h[depth], p[depth], coarse);
+
+  for (L=depth-1; L>=0; L--) expand(lev[L+1], w[L+1], h[L+1], lev[L], w[L], h[L], p[L], tmp);
+  poolFree(buf);
+}
@@ -0,0 +1,65 @@
+#ifndef __pyramid_h
+#define __pyramid_h
+
+/*
+ *    Gaussian pyramid blur, for the very wide kernels.
+ *
+ *    A kernel whose narrowest term is many pixels wide leaves nothing near
+ *    the full resolution's Nyquist, so the plane can be filtered smaller
+ *    and expanded back. Each level halves the last one each way, every new
+ *    sample (1,3,3,1)/8 of the four around it, centred between the middle
+ *    two. The half-sample mirrored edges (iirgauss.h) then carry over from
+ *    level to level. The expand back up is the same filter the other way
+ *    round.
+ *
+ *    Reducing and expanding are each close to a Gaussian blur too: each
+ *    adds a variance of PYRAMID_LEVEL_VAR of its finer level's samples,
+ *    along both axes. So at level L each term only needs what is left of
+ *    it there (pyramidSD). The kernel is applied along the rows and then
+ *    down the columns, like kernelSep, so its 2-D form has every term of
+ *    one pass against every term of the other. The whole plane therefore
+ *    goes to one level: the coarsest where even the narrowest term's
+ *    remainder brings that level's Nyquist down to tol of the peak.
+ *    Aliasing from the reduce only lands near that Nyquist, so the error
+ *    is bounded by about tol of the kernel's weight there. Anything with a
+ *    delta or a narrow term stays at level 0, where this is gaussBlurPlane.
+ *
+ *    A length that doesn't halve evenly all the way down would leave a
+ *    coarse level whose far edge is mirrored about a sample rather than
+ *    half way between two, which gaussBlurPlane can't do. So such a line
+ *    is padded first, with its own mirror image, to a multiple of 2^L
+ *    (pyramidPad). The pad's far edge is mirrored again, which is not the
+ *    line's true mirror image, so the pad goes out as far as the kernel
+ *    has more than PYRAMID_PAD_TAIL of its weight; the expand drops it.
+ *
+ *    At level L the filtering costs 4^-L of what it would at full
+ *    resolution. Reducing and expanding cost about as much as one
+ *    full-resolution pass of a short direct filter.
+ */
+
+#include "iirgauss.h"
+
+#define PYRAMID_LEVEL_VAR 0.75
+#define PYRAMID_MAX_LEVELS 12
+// No level smaller than this either way
+#define PYRAMID_MIN_SIZE 8
+// Share of the kernel (one side) allowed past the pad of a length that
+// doesn't halve evenly
+#define PYRAMID_PAD_TAIL 1e-2
+
+// What is left to do at level L of a term of SD sd (in full-resolution
+// samples), in level L's samples; 0 if the pyramid alone is wider
+double pyramidSD(double sd, int level);
+
+// The coarsest level for k in a width x height plane, as above
+// (0 = full resolution); never below PYRAMID_MIN_SIZE either way
+int pyramidLevel(const gaussSum &k, int width, int height, double tol);
+
+// The length a line of n is padded to at full resolution for level
+// k.level: n if it halves evenly that far
+int pyramidPad(const gaussSum &k, int n);
+
+// Blur a plane (as gaussBlurPlane) at level k.level
+void pyramidBlurPlane(float *plane, int width, int height, long pitch, const gaussSum &k);
+
+#endif // __pyramid_h
@@ -4,14 +4,61 @@
 
 #include "imglib.h"
 #include "kernlib.h"
+#include "iirgauss.h"
+#include "spatialplan.h"
+#include "pipeline.h"
+#include "bufpool.h"
+#include "fftplan.h"
 #include <time.h>
 #include <math.h>
 
 
+// Several frames at once, through the specialized pipeline and the FFT 
+// (all three channels): first is frame 0, with its pad set; the rest are 
+// made alike. All their planes are staged side by side in one FFT buffer,
+// so each direction is a single batch of 3*frames transforms (one plan 
+// for the group), and they share the kernel spectra.
+static void simulateGroup(img &first, unsigned char *dataPtr, int frames, int padX, int padY,
+			  const pipelineFns *fast, const pipelineParams &pp, float kern[3][7])
+{
+  int x = first.getRows(), y = first.getCols(), f, ch;
+  long frameBytes = 3L*x*y, nf = first.getFourierPix();
+  float *fftBuf = poolAllocFloat(3*nf*frames);
+  if (fftBuf==NULL) return;	// out of memory; main reports it
+  img **frame = new img*[frames];
+
+  for (f=0; f<frames; f++){
+    // (staging hands each one's planes straight back to the pool, for the next)
+    if (f==0) frame[0] = &first;
+    else{
+      frame[f] = new img(x, y);
+      frame[f]->setFourierPad(padX, padY);
+    }
+    frame[f]->stageInFFT(fftBuf + 3*nf*f);
+    fast->load(*frame[f], dataPtr + frameBytes*f, pp);
+    frame[f]->padForFFT();
+  }
+  fftRun(first.getFourierCols(), first.getFourierRows(), 3*frames, FFTW_FORWARD, fftBuf);
+
+  kernelSep convKern(first.getFourierRows(), first.getFourierCols());
+  for (ch=0; ch<3; ch++)
+    convKern.setKernFFT(ch+1, kern[ch][0], kern[ch][1], kern[ch][2], kern[ch][3], 
+			kern[ch][4], kern[ch][5], kern[ch][6]);
+  for (f=0; f<frames; f++) frame[f]->dotMultiplyFFT(convKern);
+
+  fftRun(first.getFourierCols(), first.getFourierRows(), 3*frames, FFTW_BACKWARD, fftBuf);
+  for (f=0; f<frames; f++) fast->store(*frame[f], dataPtr + frameBytes*f, pp);
+
+  for (f=1; f<frames; f++) delete frame[f];
+  delete [] frame;
+  first = img();	// before its buffer goes
+  poolFree(fftBuf);
+}
+
 void runSimulation(unsigned char *dataPtr, int x, int y, float viewDist, 
 		   float dpi, char *sensorType, char *simDisplayType, 
 		   char *viewDisplayType, float *kernelWt, float *kernelSD, 
-		   float *kernelScale)
+		   float *kernelScale, const simOptions &opts)
 {
   // 
   // This functions takes an RGB image (unsigned chars of format RGBRGBRGB... 
@@ -29,56 +76,75 @@ void runSimulation(unsigned char *dataPtr, int x, int y, float viewDist,
   // kernelScale: scale factor applied to lum, l-m, s channel kernels; 
   // defaults to 1,1,1
   //
+  // opts.model=='v' replaces the Brettel transform for protans and deutans
+  // with Vienot's single projection plane, which is just a 3x3 in LMS and
+  // so gets folded into the input tables (tritans still get Brettel).
+  // opts.model=='m' (or any opts.severity below 1) does the same with a 
+  // Machado anomalous trichromat matrix, interpolated to opts.severity.
+  //
 
-  // create the 3-plane image structure
+  // create the 3-plane image structure (empty if out of memory; main
+  // reports it)
   img image(x,y);
+  if (image.getNpix()==0) return;
 
   // Load simulated display device data
   // 
   displayDevice myDisplay(simDisplayType);
   //  myDisplay.loadDevice(simDisplayType);
 
-  // Load raw image data (uchars in dataPtr) into the float array
-  // 
-  if (myDisplay.gammaLen()-1 != image.getMaxImgVal()) // then we have to scale
-    image.assignUchar(dataPtr, (1.0*myDisplay.gammaLen()/image.getMaxImgVal()));
-  else
-    image.assignUchar(dataPtr);
-
-  // Apply Gamma correction
-  //
-  image.applyLookupTable(myDisplay.gammaPtrR(), myDisplay.gammaPtrG(), myDisplay.gammaPtrB());
-			
-  // Do Brettel/Vienot/Mollon transform only if sensor-type is not 'normal'
-  if(sensorType[0]!='n'){
+  // Pick the color space we start in. The input gamma and the first 
+  // color transform are folded into 9 look-up tables (see 
+  // displayDevice::getInputTables), so the raw uchars go straight into 
+  // that space in one pass.
+  float identity[9] = {1.0, 0.0, 0.0,  0.0, 1.0, 0.0,  0.0, 0.0, 1.0};
+  float vienot[9], anomalous[9];
+  float *firstXform = identity;
+  colorSpaceLabelType firstSpace = RGB;
+  int doBrettel = (sensorType[0]!='n');
+  if ((opts.model=='m' || opts.severity<1.0) && 
+      (sensorType[0]=='p' || sensorType[0]=='d' || sensorType[0]=='t')){
+    // rgb -> lms -> anomalous lms, all in one matrix
+    myDisplay.computeAnomalousTransform(sensorType[0], opts.severity, anomalous);
+    firstXform = anomalous;
+    firstSpace = LMS;
+    doBrettel = 0;
+  }else if (opts.model=='v' && (sensorType[0]=='p' || sensorType[0]=='d')){
+    // rgb -> lms -> dichromat lms, all in one matrix
+    myDisplay.computeVienotTransform(sensorType[0], vienot);
+    firstXform = vienot;
+    firstSpace = LMS;
+    doBrettel = 0;
+  }else if (sensorType[0]!='n'){
     // we need to go to LMS space to do the Brettel transform
-    image.changeColorSpace(myDisplay.getRGB2LMS());
-    image.colorSpaceLabel = LMS;
-    image.brettelTransform(sensorType[0], myDisplay.getRGB2LMS());
-  }else if (simDisplayType[0]!=viewDisplayType[0] && (viewDist<=0.0 || dpi<=0.0)){
+    firstXform = myDisplay.getRGB2LMS();
+    firstSpace = LMS;
+  }else if (viewDist>0.0 && dpi>0.0){
+    // the spatial work is done in opponent color space
+    firstXform = myDisplay.getRGB2OPP();
+    firstSpace = OPP;
+  }else if (simDisplayType[0]!=viewDisplayType[0]){
     // if we get here, then all that is different is the display type.
     // To get the color effects, we need to do some kind of color transform.
     // We opted to do rgb2lms just because it's way cool.
     // (without this conditional, we'd wind up doing no color-space transforms
     // when all is normal except the display type.)
-    image.changeColorSpace(myDisplay.getRGB2LMS());
-    image.colorSpaceLabel = LMS;
+    firstXform = myDisplay.getRGB2LMS();
+    firstSpace = LMS;
   }
-  // Do spatial filtering
-  //
-  if (viewDist>0.0 && dpi>0.0) {
+
+  // The spatial filter's kernels and plan come first, so that the 
+  // specialized pipeline can load the planes straight into the FFT buffer
+  // (img::stageInFFT).
+  int spatial = (viewDist>0.0 && dpi>0.0);
+  float kern[3][7];	// each channel's kW1,kSD1,kW2,kSD2,kW3,kSD3,scale (SDs in pixels)
+  gaussSum gk[3];
+  spatialPlan plan;
+  int padX = -1, padY = -1, ch, i;
+  if (spatial) {
     // convert dpi and viewDist into samples-per-degree
     float sampPerDeg = viewDist * 0.0174550649282176 * dpi;
 
-    // The spatial work is done in opponent color space
-    // 
-    switch (image.colorSpaceLabel){
-    case RGB: image.changeColorSpace(myDisplay.getRGB2OPP()); break;
-    case LMS: image.changeColorSpace(myDisplay.getLMS2OPP()); break;
-    case OPP: break;
-    }    
-    image.colorSpaceLabel = OPP;
-    
     // SPATIAL FILTER
     // Generate kernels here - either in F space or R-space and then transform
     // These are the parameters for generating the filters,
@@ -104,10 +170,6 @@ void runSimulation(unsigned char *dataPtr, int x, int y, float viewDist,
     // done in scie lab to save time by making the convolution kernels smaller.
     // Convert the unit of SDs of visual angle to pixels by * sampPerDeg   
 				
-    image.doFFT(FFTW_FORWARD);
-
-    //    kernel convKern(x,y,HAS_FFT);
-    kernelSep convKern(image.getFourierRows(),image.getFourierCols());
     if (kernelWt==NULL || kernelSD==NULL){
     //convKern.setKernFFT(1, .9207, 0.0425*sampPerDeg, .1050, 0.1911*sampPerDeg, -.1080, 5.9453*sampPerDeg, 1.0); 
     //convKern.setKernFFT(2, .5310, 0.0582*sampPerDeg, .3300, 0.7015*sampPerDeg, 0.0, 1.0, 1.0);
@@ -115,42 +177,167 @@ void runSimulation(unsigned char *dataPtr, int x, int y, float viewDist,
     //convKern.setKernFFT(1, .9207, 0.0107*sampPerDeg, .1050, 0.0479*sampPerDeg, -.1080, 1.4894*sampPerDeg, 1.0); 
     //convKern.setKernFFT(2, .5310, 0.0146*sampPerDeg, .3300, 0.1758*sampPerDeg, 0.0, 1.0, 1.0);
     //convKern.setKernFFT(3, .4877, 0.0191*sampPerDeg, .3711, 0.1373*sampPerDeg, 0.0, 1.0, 1.0);
-      convKern.setKernFFT(1, 0.9207, 0.0107*sampPerDeg, 0.0, 0.0479*sampPerDeg, 
-			  0.0, 1.4894*sampPerDeg, 1.0); 
-      convKern.setKernFFT(2, 0.5310, 0.0146*sampPerDeg, 0.0, 0.1758*sampPerDeg, 
-			  0.0, 1.0, 1.0);
-      convKern.setKernFFT(3, 0.4877, 0.0191*sampPerDeg, 0.0, 0.1373*sampPerDeg, 
-			  0.0, 1.0, 1.0);
+      const double defKern[3][7] = {
+	{0.9207, 0.0107*sampPerDeg, 0.0, 0.0479*sampPerDeg, 0.0, 1.4894*sampPerDeg, 1.0},
+	{0.5310, 0.0146*sampPerDeg, 0.0, 0.1758*sampPerDeg, 0.0, 1.0, 1.0},
+	{0.4877, 0.0191*sampPerDeg, 0.0, 0.1373*sampPerDeg, 0.0, 1.0, 1.0}};
+      for (ch=0; ch<3; ch++)
+	for (i=0; i<7; i++) kern[ch][i] = defKern[ch][i];
     }
     else{
-      convKern.setKernFFT(1, kernelWt[0], kernelSD[0]*sampPerDeg, kernelWt[1], 
-			  kernelSD[1]*sampPerDeg, kernelWt[2], 
-			  kernelSD[2]*sampPerDeg, kernelScale[0]); 
-      convKern.setKernFFT(2, kernelWt[3], kernelSD[3]*sampPerDeg, kernelWt[4], 
-			  kernelSD[4]*sampPerDeg, kernelWt[5], 
-			  kernelSD[5]*sampPerDeg, kernelScale[1]);
-      convKern.setKernFFT(3, kernelWt[6], kernelSD[6]*sampPerDeg, kernelWt[7], 
-			  kernelSD[7]*sampPerDeg, kernelWt[8], 
-			  kernelSD[8]*sampPerDeg, kernelScale[2]);
-    }		
-
-    //		convKern.doFFT(FFTW_FORWARD);
-
-    // For Debugging: 
-    //convKern.writeRawFFT("/tmp/convKern.txt");
-    //std::cerr << "sampPerDeg=" << sampPerDeg << std::endl;
-    // just doing forward fft/reverse fft is fine. The problem is with the
-    // kernel itself (mostly NaNs).
-    image.dotMultiplyFFT(convKern); // This does the convolution in F-space
-    image.doFFT(FFTW_BACKWARD);
+      for (ch=0; ch<3; ch++){
+	for (i=0; i<3; i++){
+	  kern[ch][2*i] = kernelWt[3*ch+i];
+	  kern[ch][2*i+1] = kernelSD[3*ch+i]*sampPerDeg;
+	}
+	kern[ch][6] = kernelScale[ch];
+      }
+    }
+
+    // Each channel goes whichever way is cheapest (spatialplan.h): left
+    // alone, in real space (mirrored at the edges) or by FFT. The FFT's
+    // pad is sized to the kernels: first all of them, then just the ones
+    // the FFT ended up with.
+    for (ch=0; ch<3; ch++)
+      gk[ch].setKern(kern[ch][0], kern[ch][1], kern[ch][2], kern[ch][3], 
+		     kern[ch][4], kern[ch][5], kern[ch][6]);
+    image.setFourierPad(spatialPad(gk, x, opts.pad, 7), spatialPad(gk, y, opts.pad, 7));
+    planSpatial(gk, x, y, image.getFourierRows(), image.getFourierCols(), opts.spatial, opts.pyramidTol, plan);
+    if (opts.verbose) printSpatialPlan(plan);
+    if (plan.fftChannels){
+      padX = spatialPad(gk, x, opts.pad, plan.fftChannels);
+      padY = spatialPad(gk, y, opts.pad, plan.fftChannels);
+      image.setFourierPad(padX, padY);
+      if (opts.verbose)
+	std::cerr << "fft pad (" << (opts.pad=='e' ? "exact" : "fast") << "): " << padX << "," << padY 
+		  << " -> " << image.getFourierRows() << "," << image.getFourierCols()
+		  << " (+" << (int)(100.0*((double)image.getFourierRows()*image.getFourierCols()/((double)x*y)-1.0)+0.5)
+		  << "% pixels)" << std::endl;
+    }
+  }
+
+  // The common configurations have a specialized pipeline (pipeline.h) 
+  // that does all the per-pixel stages in one loop; the rest go through 
+  // the general one below.
+  const pipelineFns *fast = selectPipeline(firstSpace, doBrettel ? sensorType[0] : 'n', spatial);
+
+  // More than one frame: the specialized pipeline takes them all at once,
+  // without a spatial filter or with an all-FFT one (simulateGroup). 
+  // Anything else goes one frame at a time.
+  int grouped = fast && (!spatial || (plan.fftChannels==7 && opts.planes==FLOAT32));
+  if (opts.frames > 1 && !grouped){
+    simOptions one = opts;
+    one.frames = 1;
+    image = img();	// its planes back to the pool first
+    for (i=0; i<opts.frames; i++)
+      runSimulation(dataPtr + 3L*x*y*i, x, y, viewDist, dpi, sensorType, simDisplayType, 
+		    viewDisplayType, kernelWt, kernelSD, kernelScale, one);
+    return;
+  }
+
+  // Load raw image data (uchars in dataPtr) into the float array,
+  // applying the gamma correction and first transform on the way in
+  // 
+  float scale = 1.0;
+  if (myDisplay.gammaLen()-1 != image.getMaxImgVal()) // then we have to scale
+    scale = 1.0*myDisplay.gammaLen()/image.getMaxImgVal();
+
+  displayDevice viewDisplay(viewDisplayType);
+  pipelineParams pp;
+  if (fast){
+    pp.inTables = myDisplay.getInputTables(firstXform, scale);
+    if (doBrettel) img::brettelParams(sensorType[0], myDisplay.getRGB2LMS(), pp.brettel);
+    float *toOpp = (firstSpace==LMS) ? myDisplay.getLMS2OPP() : myDisplay.getRGB2OPP();
+    float *toRGB = identity;
+    if (spatial || firstSpace==OPP) toRGB = viewDisplay.getOPP2RGB();
+    else if (firstSpace==LMS) toRGB = viewDisplay.getLMS2RGB();
+    for (int i=0; i<9; i++){
+      pp.toOpp[i] = toOpp[i];
+      pp.toRGB[i] = toRGB[i];
+    }
+    pp.invGamma[0] = viewDisplay.invGammaPtrR();
+    pp.invGamma[1] = viewDisplay.invGammaPtrG();
+    pp.invGamma[2] = viewDisplay.invGammaPtrB();
+    pp.gammaLen = viewDisplay.gammaLen();
+    pp.buildOutTables();
+    pp.maxImgVal = image.getMaxImgVal();
+    if (!spatial){
+      fixedTables *ft = opts.fixedPoint ? new fixedTables : NULL;
+      int useFixed = ft && fast->buildFixed(*ft, myDisplay, firstXform, scale, pp);
+      for (i=0; i<opts.frames; i++){
+	unsigned char *frame = dataPtr + 3L*image.getNpix()*i;
+	if (useFixed) fast->runFixed(frame, frame, image.getNpix(), *ft, pp);
+	else fast->run(frame, frame, image.getNpix(), pp);
+      }
+      delete ft;
+      return;
+    }
+    if (opts.frames > 1){
+      simulateGroup(image, dataPtr, opts.frames, padX, padY, fast, pp, kern);
+      return;
+    }
+    // only the specialized pipeline knows about 16-bit planes, or about 
+    // loading straight into the FFT buffer
+    image.setPlaneStorage(opts.planes);
+    if (plan.fftChannels) image.stageInFFT();
+    fast->load(image, dataPtr, pp);
+  }else{
+    image.assignUcharLinear(dataPtr, myDisplay.getInputTables(firstXform, scale));
+    image.colorSpaceLabel = firstSpace;
+			
+    // Do Brettel/Vienot/Mollon transform only if sensor-type is not 'normal'
+    if(doBrettel)
+      image.brettelTransform(sensorType[0], myDisplay.getRGB2LMS());
+  }
+
+  // Do spatial filtering
+  //
+  if (spatial) {
+    // The spatial work is done in opponent color space
+    // 
+    switch (image.colorSpaceLabel){
+    case RGB: image.changeColorSpace(myDisplay.getRGB2OPP()); break;
+    case LMS: image.changeColorSpace(myDisplay.getLMS2OPP()); break;
+    case OPP: break;
+    }    
+    image.colorSpaceLabel = OPP;
+    
+
+    if (plan.realChannels) image.gaussFilter(gk, plan.realChannels);
+    if (plan.dctChannels) image.dctFilter(kern, plan.dctChannels);
+    if (plan.fftChannels){
+      image.doFFT(FFTW_FORWARD, plan.fftChannels);
+
+      //    kernel convKern(x,y,HAS_FFT);
+      kernelSep convKern(image.getFourierRows(),image.getFourierCols());
+      for (ch=0; ch<3; ch++)
+	if (plan.fftChannels & (1<<ch))
+	  convKern.setKernFFT(ch+1, kern[ch][0], kern[ch][1], kern[ch][2], kern[ch][3], 
+			      kern[ch][4], kern[ch][5], kern[ch][6]);
+
+      //		convKern.doFFT(FFTW_FORWARD);
+
+      // For Debugging: 
+      //convKern.writeRawFFT("/tmp/convKern.txt");
+      //std::cerr << "sampPerDeg=" << sampPerDeg << std::endl;
+      // just doing forward fft/reverse fft is fine. The problem is with the
+      // kernel itself (mostly NaNs).
+      image.dotMultiplyFFT(convKern, plan.fftChannels); // This does the convolution in F-space
+      image.doFFT(FFTW_BACKWARD, plan.fftChannels);
+    }
+  }
+
+  if (fast){
+    // back to RGB, clip, inverse gamma and out to bytes in one go
+    fast->store(image, dataPtr, pp);
+    return;
   }
     
   // Convert back to RGB
   // 
-  myDisplay.loadDevice(viewDisplayType);
   switch (image.colorSpaceLabel){
-  case LMS: image.changeColorSpace(myDisplay.getLMS2RGB()); break;
-  case OPP: image.changeColorSpace(myDisplay.getOPP2RGB()); break;
+  case LMS: image.changeColorSpace(viewDisplay.getLMS2RGB()); break;
+  case OPP: image.changeColorSpace(viewDisplay.getOPP2RGB()); break;
   case RGB: break;
   }  
   image.colorSpaceLabel = RGB;
@@ -162,7 +349,8 @@ void runSimulation(unsigned char *dataPtr, int x, int y, float viewDist,
 
   // Apply Inverse Gamma
   //
-  image.applyLookupTable(myDisplay.invGammaPtrR(), myDisplay.invGammaPtrG(), myDisplay.invGammaPtrB());
+  image.applyLookupTable(viewDisplay.invGammaPtrR(), viewDisplay.invGammaPtrG(), viewDisplay.invGammaPtrB(),
+			 viewDisplay.gammaLen());
 
   // Put image data back into the uchar array
   // 
@@ -180,23 +368,15 @@ void runCorrection(unsigned char *dataPtr, int x, int y, char *simDisplayType,
   // with dimention x,y) and applies the Daltonize correction.
   //
 
-  // create the 3-plane image structure
+  // create the 3-plane image structure (empty if out of memory; main
+  // reports it)
   img image(x,y);
+  if (image.getNpix()==0) return;
 
-  // Load simulated display device data
-  // 
-  displayDevice myDisplay(simDisplayType);
-  //  myDisplay.loadDevice(simDisplayType);
-
-  // Load raw image data (uchars in dataPtr) into the float array
-  // 
-  if (myDisplay.gammaLen()-1 != image.getMaxImgVal()) // then we have to scale
-    image.assignUchar(dataPtr, (1.0*myDisplay.gammaLen()/image.getMaxImgVal()));
-  else
-    image.assignUchar(dataPtr);
-
-  // *** FIX ME: The following is inefficient
-  image.daltonize(lumScale, sScale, lmStretch);
+  // Load the raw image data (uchars in dataPtr) and apply the correction.
+  // daltonize loads them straight into opponent space (gamma and rgb2opp 
+  // folded into its input tables).
+  image.daltonize(dataPtr, lumScale, sScale, lmStretch);
 
 //   // Apply Gamma correction
 //   //
@@ -1,9 +1,42 @@
 #ifndef __runSimulation_h
 #define __runSimulation_h
 
+#include "imglib.h"
+
+// Options that pick between alternative implementations of the simulation.
+// The defaults reproduce the original Vischeck behaviour.
+struct simOptions {
+  char model;		// dichromat model: 'b' = Brettel (two half-planes), 
+			// 'v' = Vienot (single plane, protan/deutan only),
+			// 'm' = Machado (severity-indexed 3x3)
+  float severity;	// 0-1; anything below 1 simulates an anomalous 
+			// trichromat and implies model 'm'
+  int fixedPoint;	// non-spatial 8-bit runs in integer arithmetic 
+			// (see pipeline.h); the same output as in float
+  planeStorageType planes;	// how the img planes of a spatial run are 
+			// stored; the 16-bit types halve their memory
+  char spatial;		// spatial filter: 'f' = padded FFT convolution, 
+			// 'i' = real space (recursive Gaussians, iirgauss.h),
+			// 'd' = DCT with mirrored edges (img::dctFilter),
+			// 'a' = whichever is cheapest, channel by channel 
+			// (spatialplan.h), 'p' = real space, each channel 
+			// as far down a Gaussian pyramid as its kernel 
+			// allows (pyramid.h)
+  float pyramidTol;	// for 'p': the response allowed at a level's Nyquist
+  char pad;		// FFT pad: 'f' = fast, 'e' = exact (spatialPad)
+  int frames;		// x by y images back to back in dataPtr, all 
+			// simulated alike; where the whole spatial filter 
+			// is by FFT they are transformed as one group
+  int verbose;		// report the spatial plan and FFT pad on cerr (-v)
+
+  simOptions() : model('b'), severity(1.0), fixedPoint(0), planes(FLOAT32), spatial('f'),
+		 pyramidTol(1e-2), pad('f'), frames(1), verbose(0) {}
+};
+
 void runSimulation(unsigned char *dataPtr, int x, int y, float viewDist, float dpi, char *sensorType,
 		   char *simDisplayType, char *viewDisplayType, float *kernelWt, 
-		   float *kernelSDdouble, float *kernelScale);
+		   float *kernelSDdouble, float *kernelScale, 
+		   const simOptions &opts = simOptions());
 
 
 void runCorrection(unsigned char *dataPtr, int x, int y, char *simDisplayType, 
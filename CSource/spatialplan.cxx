@@ -0,0 +1,209 @@
+#include "spatialplan.h"
+#include "fftplan.h"
+#include "pyramid.h"
+#include <math.h>
+#include <unistd.h>
+#include <iostream>
+
+// Per sample, one term over one line of n
+static double termCost(const gaussSum &k, int i, int n)
+{
+  double sd = k.sd[i];
+  int R;
+
+  if (k.how[i]==TERM_DELTA) return SPATIAL_COST_DELTA;
+  if (sd >= 2.0*n) return SPATIAL_COST_MEAN;
+  if (k.how[i]==TERM_DIRECT){
+    R = (int)ceil(4.0*sd);
+    if (R > DIRECT_MAX_RADIUS) R = DIRECT_MAX_RADIUS;
+    return SPATIAL_COST_TAP0 + SPATIAL_COST_TAP*R;
+  }
+  // both sides' corrections, each up to the whole line
+  return SPATIAL_COST_RECURSIVE + SPATIAL_COST_TAIL*2.0*recursiveTail(sd, n)/n;
+}
+
+// Nothing but deltas? Then gain is what they add up to.
+static int deltasOnly(const gaussSum &k, float &gain)
+{
+  int i;
+  gain = 0.0;
+  for (i=0; i<k.n; i++){
+    if (k.how[i]!=TERM_DELTA) return 0;
+    gain += k.weight[i];
+  }
+  return 1;
+}
+
+// Per pixel, in real space as marked
+static double realCost(const gaussSum &k, int width, int height)
+{
+  double cost = 2.0*SPATIAL_COST_LINE;
+  float gain;
+  int i;
+
+  if (deltasOnly(k, gain)) return SPATIAL_COST_GAIN;
+  for (i=0; i<k.n; i++) cost += termCost(k, i, width) + termCost(k, i, height);
+  return cost;
+}
+
+// Per pixel, at k.level
+static double pyramidCost(const gaussSum &k, int width, int height)
+{
+  double cost = 0.0, scale = 1.0;
+  gaussSum coarse = k;
+  int L, i, padW = pyramidPad(k, width), padH = pyramidPad(k, height);
+
+  for (L=0; L<k.level; L++){
+    cost += scale*SPATIAL_COST_PYRAMID;
+    scale *= (L==0) ? 0.25*padW*padH/((double)width*height) : 0.25;
+  }
+  width = padW >> k.level;
+  height = padH >> k.level;
+  for (i=0; i<k.n && k.level; i++){
+    coarse.sd[i] = pyramidSD(k.sd[i], k.level);
+    coarse.how[i] = (coarse.sd[i] < IIR_MIN_SD) ? TERM_DIRECT : TERM_RECURSIVE;
+  }
+  return cost + scale*realCost(coarse, width, height);
+}
+
+// Mark each term delta, direct or recursive, whichever is cheapest
+static void markTerms(gaussSum &k, int width, int height)
+{
+  double direct, recursive;
+  int i;
+
+  for (i=0; i<k.n; i++){
+    double sd = k.sd[i];
+    if (offCentreShare(sd) < DELTA_SHARE) k.how[i] = TERM_DELTA;
+    else if (sd < IIR_MIN_SD) k.how[i] = TERM_DIRECT;
+    else if (ceil(4.0*sd) > DIRECT_MAX_RADIUS) k.how[i] = TERM_RECURSIVE;
+    else{
+      k.how[i] = TERM_DIRECT;
+      direct = termCost(k, i, width) + termCost(k, i, height);
+      k.how[i] = TERM_RECURSIVE;
+      recursive = termCost(k, i, width) + termCost(k, i, height);
+      if (direct < recursive) k.how[i] = TERM_DIRECT;
+    }
+  }
+}
+
+static int largestPrime(int n)
+{
+  int p, big = 1;
+  for (p=2; p*p<=n; p++)
+    while (n%p==0){
+      big = p;
+      n /= p;
+    }
+  return (n > 1) ? n : big;
+}
+
+// A line of n's share of the per-pixel DCT cost
+static double dctLine(int n)
+{
+  double c = log2((double)n);
+  return (largestPrime(n) > DCT_MAX_PRIME) ? SPATIAL_DCT_ROUGH*c : c;
+}
+
+void planSpatial(gaussSum kern[3], int width, int height, int fourierRows,
+		 int fourierCols, char engines, double pyramidTol, spatialPlan &plan)
+{
+  double npix = (double)width*height, nf = (double)fourierRows*fourierCols;
+  // the FFT threads only help as far as there are cores to run them
+  int threads = fftGetThreads(), cores = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if (cores > 0 && threads > cores) threads = cores;
+  double fft = nf*(SPATIAL_COST_FFT*2.0*log2(nf)/threads + SPATIAL_COST_FFT_PIX);
+  double dct = npix*(SPATIAL_COST_DCT*2.0*(dctLine(width)+dctLine(height))/threads + SPATIAL_COST_DCT_PIX);
+  float gain;
+  int ch, i;
+
+  plan.realChannels = plan.fftChannels = plan.dctChannels = 0;
+  for (ch=0; ch<3; ch++){
+    markTerms(kern[ch], width, height);
+    kern[ch].level = (engines=='p') ? pyramidLevel(kern[ch], width, height, pyramidTol) : 0;
+    plan.realMs[ch] = plan.fftMs[ch] = plan.dctMs[ch] = -1.0;
+    if (deltasOnly(kern[ch], gain) && fabs(gain-1.0) < 1e-4){
+      plan.method[ch] = SPATIAL_NONE;
+      continue;
+    }
+    if (engines=='i' || engines=='a') plan.realMs[ch] = npix*realCost(kern[ch], width, height)*1e-6;
+    if (engines=='p') plan.realMs[ch] = npix*pyramidCost(kern[ch], width, height)*1e-6;
+    if (engines=='f' || engines=='a') plan.fftMs[ch] = fft*1e-6;
+    if (engines=='d' || engines=='a') plan.dctMs[ch] = dct*1e-6;
+
+    if (plan.dctMs[ch] >= 0.0 && (plan.fftMs[ch] < 0.0 || plan.dctMs[ch] < plan.fftMs[ch]) &&
+	(plan.realMs[ch] < 0.0 || plan.dctMs[ch] < plan.realMs[ch])){
+      plan.method[ch] = SPATIAL_DCT;
+      plan.dctChannels |= 1<<ch;
+      continue;
+    }
+    if (plan.realMs[ch] < 0.0 || (plan.fftMs[ch] >= 0.0 && plan.fftMs[ch] < plan.realMs[ch])){
+      plan.method[ch] = SPATIAL_FFT;
+      plan.fftChannels |= 1<<ch;
+      continue;
+    }
+    plan.method[ch] = SPATIAL_DIRECT;
+    for (i=0; i<kern[ch].n; i++)
+      if (kern[ch].how[i]==TERM_RECURSIVE) plan.method[ch] = SPATIAL_RECURSIVE;
+    if (kern[ch].level) plan.method[ch] = SPATIAL_PYRAMID;
+    plan.realChannels |= 1<<ch;
+  }
+}
+
+void printSpatialPlan(const spatialPlan &plan)
+{
+  static const char *chName[3] = {"lum", "red-green", "blue-yellow"};
+  static const char *methodName[6] = {"none", "direct", "recursive", "fft", "dct", "pyramid"};
+  int ch;
+
+  for (ch=0; ch<3; ch++){
+    std::cerr << "spatial " << chName[ch] << ": " << methodName[plan.method[ch]];
+    const char *sep = " (";
+    if (plan.realMs[ch] >= 0.0){
+      std::cerr << sep << "real space ~" << (int)(plan.realMs[ch]+0.5) << " ms";
+      sep = ", ";
+    }
+    if (plan.fftMs[ch] >= 0.0){
+      std::cerr << sep << "fft ~" << (int)(plan.fftMs[ch]+0.5) << " ms";
+      sep = ", ";
+    }
+    if (plan.dctMs[ch] >= 0.0){
+      std::cerr << sep << "dct ~" << (int)(plan.dctMs[ch]+0.5) << " ms";
+      sep = ", ";
+    }
+    if (sep[0]==',') std::cerr << ")";
+    std::cerr << std::endl;
+  }
+}
+
+// The masked channels' weight past s on one side, over their total
+static double tailShare(const gaussSum kern[3], int channels, double s)
+{
+  double tail = 0.0, total = 0.0;
+  int ch, i;
+
+  for (ch=0; ch<3; ch++){
+    if (!(channels & (1<<ch))) continue;
+    for (i=0; i<kern[ch].n; i++){
+      double w = fabs(kern[ch].weight[i]);
+      total += w;
+      tail += 0.5*w*erfc(s/(1.414213562373*kern[ch].sd[i]));
+    }
+  }
+  return (total > 0.0) ? tail/total : 0.0;
+}
+
+int spatialPad(const gaussSum kern[3], int n, char policy, int channels)
+{
+  double eps = (policy=='e') ? PAD_EXACT_TAIL : PAD_FAST_TAIL;
+  int lo = 0, hi = n, mid;
+
+  // the smallest reach that leaves no more than eps outside
+  if (tailShare(kern, channels, hi) > eps) return n;
+  while (lo < hi){
+    mid = (lo+hi)/2;
+    if (tailShare(kern, channels, mid) > eps) lo = mid+1;
+    else hi = mid;
+  }
+  return (2*lo < n) ? 2*lo : n;
+}
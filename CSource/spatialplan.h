@@ -0,0 +1,102 @@
+#ifndef __spatialplan_h
+#define __spatialplan_h
+
+/*
+ *    Per-channel choice of spatial filter.
+ *
+ *    The three opponent channels' kernels can be orders of magnitude apart
+ *    in pixels, so no one method suits them all. planSpatial looks at each
+ *    channel's Gaussian terms and the image size and picks:
+ *
+ *      none       every term is too narrow to move any weight off the
+ *                 centre pixel and the gain is 1: the plane isn't touched
+ *      direct     real space (iirgauss.h), with short direct filters (or a
+ *                 plain gain, or a line mean for terms far wider than the
+ *                 image) and no recursive terms
+ *      recursive  real space, with at least one recursive Gaussian
+ *      fft        the padded FFT convolution
+ *      dct        DCT-II, multiply, DCT-III (img::dctFilter): the mirrored
+ *                 edges exactly, with no pad, but FFTW's DCTs are slower
+ *                 per sample than its r2c, and much slower where a
+ *                 dimension has a large prime factor
+ *      pyramid    real space, on a coarser level of a Gaussian pyramid
+ *                 (pyramid.h) where every term is wide enough; within
+ *                 the tolerance given, not exact
+ *
+ *    whichever the cost model below says is cheapest, among the methods
+ *    the engine setting allows ('f' = fft, 'i' = real space, 'd' = dct,
+ *    'a' = any of those, 'p' = pyramid; 'none' is always allowed). It 
+ *    also marks each real-space term direct or recursive, by the same 
+ *    costs, and with 'p' picks each kernel's pyramid level. 'a' leaves the 
+ *    pyramid out: it is the one that trades accuracy for time.
+ *
+ *    spatialPad sizes the FFT's pad from the kernels themselves: enough
+ *    that only a small share of their weight ('fast') or next to none
+ *    ('exact') reaches past each edge's mirrored reach.
+ *
+ *    The costs (the SPATIAL_COST_ defines) are per-sample times in ns, from
+ *    timing each kind of term on its own on an x86-64 build at -O3, 1 to
+ *    10 Mpixel, then scaling to fit whole runs. Only their ratios matter.
+ *    The FFT's and DCT's are divided over the FFT threads (-j); the
+ *    real-space filters run on one.
+ */
+
+#include "iirgauss.h"
+
+// A term moving less than this share of its weight off the centre pixel
+// (SD under about 0.25 pixel) is taken as a delta
+#define DELTA_SHARE 1e-3
+
+// Real space, per sample per pass (rows, then columns)
+#define SPATIAL_COST_LINE 1.4		// copying the lines in and out
+#define SPATIAL_COST_DELTA 0.2
+#define SPATIAL_COST_MEAN 0.15
+#define SPATIAL_COST_TAP0 0.15		// direct filter, plus per tap pair
+#define SPATIAL_COST_TAP 0.25
+#define SPATIAL_COST_RECURSIVE 2.2
+#define SPATIAL_COST_TAIL 1.1		// per sample of the edge corrections
+#define SPATIAL_COST_GAIN 0.3		// per pixel, a gain-only channel
+// FFT, per padded pixel: each transform per log2(pixels), and the pad,
+// multiply and unpad
+#define SPATIAL_COST_FFT 0.95
+#define SPATIAL_COST_FFT_PIX 2.2
+// DCT, per pixel: as the FFT, and the multiply; a dimension with a prime
+// factor over DCT_MAX_PRIME costs SPATIAL_DCT_ROUGH times as much
+#define SPATIAL_COST_DCT 1.25
+#define SPATIAL_COST_DCT_PIX 0.8
+#define DCT_MAX_PRIME 64
+#define SPATIAL_DCT_ROUGH 4.0
+// Pyramid, per sample of the finer level: the reduce to the next level and
+// the expand back
+#define SPATIAL_COST_PYRAMID 1.5
+
+// FFT pad policies: the share of the kernels' weight allowed past the pad
+#define PAD_FAST_TAIL 1e-2
+#define PAD_EXACT_TAIL 1e-5
+
+enum spatialMethod {SPATIAL_NONE, SPATIAL_DIRECT, SPATIAL_RECURSIVE, SPATIAL_FFT, SPATIAL_DCT,
+		    SPATIAL_PYRAMID};
+
+struct spatialPlan {
+  spatialMethod method[3];
+  double realMs[3], fftMs[3], dctMs[3];	// the estimates, < 0 where not allowed
+  int realChannels, fftChannels, dctChannels;	// masks, as img::doFFT 
+						// (pyramid channels are real)
+};
+
+// Plan the three channels of a width x height image whose FFT would be
+// fourierRows x fourierCols; sets kern[ch].how (and .level, by 
+// pyramidTol) for the real-space ones
+void planSpatial(gaussSum kern[3], int width, int height, int fourierRows,
+		 int fourierCols, char engines, double pyramidTol, spatialPlan &plan);
+void printSpatialPlan(const spatialPlan &plan);	// to cerr
+
+// The pad (in samples) for a line of n, for the FFT of the channels in the
+// mask: twice the reach s past which the weight of each kernel's Gaussians
+// (one side) is at most PAD_FAST_TAIL ('f') or PAD_EXACT_TAIL ('e') of
+// their total, so each edge has s of its own mirror image (img::
+// setFourierPad). Never more than n: that's the whole mirror image, exact
+// for any width (bar rounding up to a good FFT size).
+int spatialPad(const gaussSum kern[3], int n, char policy, int channels);
+
+#endif // __spatialplan_h